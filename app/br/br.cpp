@@ -91,6 +91,9 @@ public:
                 check(parc >= 1, "Insufficient parameter count for 'enroll'.");
                 if (parc == 1) br_enroll(parv[0]);
                 else           br_enroll_n(parc-1, parv, parv[parc-1]);
+            } else if (!strcmp(fun, "enrollMultiple")) {
+                check(parc >= 2, "Insufficient parameter count for 'enrollMultiple'.");
+                br_enroll_multiple(parv[0], parc-1, &parv[1]);
             } else if (!strcmp(fun, "compare")) {
                 check((parc >= 2) && (parc <= 3), "Incorrect parameter count for 'compare'.");
                 br_compare(parv[0], parv[1], parc == 3 ? parv[2] : "");
@@ -250,6 +253,7 @@ private:
                "==== Core Commands ====\n"
                "-train <gallery> ... <gallery> [{model}]\n"
                "-enroll <input_gallery> ... <input_gallery> {output_gallery}\n"
+               "-enrollMultiple <input_gallery> {output_gallery[algorithm=...]} ... {output_gallery[algorithm=...]}\n"
                "-compare <target_gallery> <query_gallery> [{output}]\n"
                "-eval <simmat> [<mask>] [{csv}] [{matches}]\n"
                "-plot <file> ... <file> {destination}\n"
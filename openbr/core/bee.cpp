@@ -147,6 +147,10 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
 
     // Get matrix size
     const QStringList words = QString(file.readLine()).split(" ");
+    if (words[0][1] == 'I') {
+        file.close();
+        return readMask(matrix).toMat();
+    }
     const int rows = words[1].toInt();
     const int cols = words[2].toInt();
     const bool isMask = words[0][1] == 'B';
@@ -176,22 +180,12 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
     return result;
 }
 
-void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+static void writeHeader(QFile &file, const QString &matrixType, int rows, int cols, const QString &targetSigset, const QString &querySigset)
 {
-    bool isMask = false;
-    if (m.type() == OpenCVType<BEE::MaskValue,1>::make())
-        isMask = true;
-    else if (m.type() != OpenCVType<BEE::SimmatValue,1>::make())
-        qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
-
-    const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
-    const QString matrixType = isMask ? "B" : "F";
-
     char buff[4];
-    QFile file(fileName);
     QtUtils::touchDir(file);
     if (!file.open(QFile::WriteOnly))
-        qFatal("Unable to open %s for writing.", qPrintable(fileName));
+        qFatal("Unable to open %s for writing.", qPrintable(file.fileName()));
     file.write("S2\n");
     file.write(qPrintable(targetSigset));
     file.write("\n");
@@ -200,14 +194,29 @@ void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSig
     file.write("M");
     file.write(qPrintable(matrixType));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.rows)));
+    file.write(qPrintable(QString::number(rows)));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.cols)));
+    file.write(qPrintable(QString::number(cols)));
     file.write(" ");
     const int endian = 0x12345678;
     memcpy(&buff, &endian, 4);
     file.write(buff, 4);
     file.write("\n");
+}
+
+void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+{
+    bool isMask = false;
+    if (m.type() == OpenCVType<BEE::MaskValue,1>::make())
+        isMask = true;
+    else if (m.type() != OpenCVType<BEE::SimmatValue,1>::make())
+        qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
+
+    const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+    const QString matrixType = isMask ? "B" : "F";
+
+    QFile file(fileName);
+    writeHeader(file, matrixType, m.rows, m.cols, targetSigset, querySigset);
     file.write((const char*)m.data, m.rows*m.cols*elemSize);
     file.close();
 }
@@ -224,109 +233,220 @@ void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const
     writeMatrix(readMatrix(matrix), matrix, targetSigset, querySigset);
 }
 
-void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask)
+// Masks are written densely unless the file requests otherwise, e.g. "MEDS.mask[implicit]"
+static void writeMask(const Mask &mask, const File &file, const QString &fileName, const QString &targetSigset, const QString &querySigset)
 {
-    qDebug("Making mask from %s and %s to %s", qPrintable(targetInput), qPrintable(queryInput), qPrintable(mask));
+    if (file.get<bool>("implicit", false)) mask.write(fileName, targetSigset, querySigset);
+    else                                   writeMatrix(mask.toMat(), fileName, targetSigset, querySigset);
+}
+
+static void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask, bool pairwise)
+{
+    const File maskFile(mask);
     const FileList targets = TemplateList::fromGallery(targetInput).files();
     const FileList queries = (queryInput == ".") ? targets : TemplateList::fromGallery(queryInput).files();
     const int partitions = targets.first().get<int>("crossValidate");
     if (partitions == 0) {
-        writeMatrix(makeMask(targets, queries), mask, targetInput, queryInput);
+        writeMask(Mask(targets, queries, 0, pairwise), maskFile, maskFile.name, targetInput, queryInput);
     } else {
-        if (!mask.contains("%1")) qFatal("Mask file name missing partition number place marker (%%1)");
+        if (!maskFile.name.contains("%1")) qFatal("Mask file name missing partition number place marker (%%1)");
         for (int i=0; i<partitions; i++) {
-            writeMatrix(makeMask(targets, queries, i), mask.arg(i), targetInput, queryInput);
+            writeMask(Mask(targets, queries, i, pairwise), maskFile, maskFile.name.arg(i), targetInput, queryInput);
         }
     }
 }
 
+void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask)
+{
+    qDebug("Making mask from %s and %s to %s", qPrintable(targetInput), qPrintable(queryInput), qPrintable(mask));
+    makeMask(targetInput, queryInput, mask, false);
+}
+
 void makePairwiseMask(const QString &targetInput, const QString &queryInput, const QString &mask)
 {
     qDebug("Making pairwise mask from %s and %s to %s", qPrintable(targetInput), qPrintable(queryInput), qPrintable(mask));
-    const FileList targets = TemplateList::fromGallery(targetInput).files();
-    const FileList queries = (queryInput == ".") ? targets : TemplateList::fromGallery(queryInput).files();
-    const int partitions = targets.first().get<int>("crossValidate");
-    if (partitions == 0) {
-        writeMatrix(makePairwiseMask(targets, queries), mask, targetInput, queryInput);
-    } else {
-        if (!mask.contains("%1")) qFatal("Mask file name missing partition number place marker (%%1)");
-        for (int i=0; i<partitions; i++) {
-            writeMatrix(makePairwiseMask(targets, queries, i), mask.arg(i), targetInput, queryInput);
-        }
-    }
+    makeMask(targetInput, queryInput, mask, true);
 }
 
 Mat makePairwiseMask(const FileList &targets, const FileList &queries, int partition)
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
+    return Mask(targets, queries, partition, true).toMat();
+}
+
+Mat makeMask(const FileList &targets, const FileList &queries, int partition)
+{
+    return Mask(targets, queries, partition).toMat();
+}
+
+static qint32 intern(QHash<QString, qint32> &ids, const QString &value)
+{
+    QHash<QString, qint32>::const_iterator it = ids.constFind(value);
+    if (it != ids.constEnd())
+        return it.value();
+    const qint32 id = ids.size();
+    ids.insert(value, id);
+    return id;
+}
+
+/* Mask - public methods */
+Mask::Mask(const Mat &mask)
+    : _rows(mask.rows), _cols(mask.cols), dense(mask), partition(0), pairwise(false)
+{
+    if (mask.type() != CV_8UC1)
+        qFatal("Invalid mask format");
+}
+
+Mask::Mask(const FileList &targets, const FileList &queries, int partition, bool pairwise)
+    : _rows(queries.size()), _cols(pairwise ? 1 : targets.size()), partition(partition), pairwise(pairwise)
+{
+    if (pairwise && (targets.size() != queries.size()))
+        qFatal("Pairwise masks require equal length target and query sets.");
+
+    // Intern file names and labels so comparisons are integer equality
+    QHash<QString, qint32> fileIds, labelIds;
     const QList<int> targetPartitions = targets.crossValidationPartitions();
     const QList<int> queryPartitions = queries.crossValidationPartitions();
 
-    Mat mask(queries.size(), 1, CV_8UC1);
+    // TODO: Direct use of "Label" isn't general -cao
+    targetIds.reserve(targets.size());
+    for (int i=0; i<targets.size(); i++) {
+        const QString label = targets[i].get<QString>("Label", "-1");
+        const Ids ids = { intern(fileIds, targets[i].name),
+                          label == "-1" ? -1 : intern(labelIds, label),
+                          targetPartitions[i], 0 };
+        targetIds.append(ids);
+    }
+
+    queryIds.reserve(queries.size());
     for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-
-        const QString &fileB = targets[i];
-        const QString labelB = targetLabels[i];
-        const int partitionB = targetPartitions[i];
-
-        MaskValue val;
-        if      (fileA == fileB)           val = DontCare;
-        else if (labelA == "-1")           val = DontCare;
-        else if (labelB == "-1")           val = DontCare;
-        else if (partitionA != partition)  val = DontCare;
-        else if (partitionB == -1)         val = NonMatch;
-        else if (partitionB != partition)  val = DontCare;
-        else if (labelA == labelB)         val = Match;
-        else                               val = NonMatch;
-        mask.at<MaskValue>(i,0) = val;
+        const QString label = queries[i].get<QString>("Label", "-1");
+        const Ids ids = { intern(fileIds, queries[i].name),
+                          label == "-1" ? -1 : intern(labelIds, label),
+                          queryPartitions[i], !pairwise && queries[i].get<bool>("targetOnly", false) };
+        queryIds.append(ids);
     }
 
+    indexLabels();
+}
+
+MaskValue Mask::at(int row, int col) const
+{
+    if (!dense.empty())
+        return dense.at<MaskValue>(row, col);
+
+    const Ids &a = queryIds[row];
+    const Ids &b = targetIds[pairwise ? row : col];
+    if      (a.file == b.file)           return DontCare;
+    else if (a.targetOnly)               return DontCare;
+    else if (a.label == -1)              return DontCare;
+    else if (b.label == -1)              return DontCare;
+    else if (a.partition != partition)   return DontCare;
+    else if (b.partition == -1)          return NonMatch;
+    else if (b.partition != partition)   return DontCare;
+    else if (a.label == b.label)         return Match;
+    else                                 return NonMatch;
+}
+
+QList<int> Mask::genuines(int row) const
+{
+    QList<int> columns;
+    if (!dense.empty() || pairwise) {
+        for (int j=0; j<_cols; j++)
+            if (at(row, j) == Match)
+                columns.append(j);
+    } else if (queryIds[row].label != -1) {
+        foreach (int j, labelTargets.value(queryIds[row].label))
+            if (at(row, j) == Match)
+                columns.append(j);
+    }
+    return columns;
+}
+
+Mat Mask::toMat() const
+{
+    if (!dense.empty())
+        return dense;
+
+    Mat mask(_rows, _cols, CV_8UC1);
+    for (int i=0; i<_rows; i++) {
+        MaskValue *row = mask.ptr<MaskValue>(i);
+        for (int j=0; j<_cols; j++)
+            row[j] = at(i, j);
+    }
     return mask;
 }
 
-Mat makeMask(const FileList &targets, const FileList &queries, int partition)
+void Mask::write(const QString &fileName, const QString &targetSigset, const QString &querySigset) const
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
-    const QList<int> targetPartitions = targets.crossValidationPartitions();
-    const QList<int> queryPartitions = queries.crossValidationPartitions();
-    const QList<bool> targetsOnly = File::get<bool>(queries, "targetOnly", false);
+    if (!dense.empty()) {
+        writeMatrix(dense, fileName, targetSigset, querySigset);
+        return;
+    }
 
-    Mat mask(queries.size(), targets.size(), CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-        const bool targetOnly = targetsOnly[i];
+    // Header followed by the partition, pairwise flag, query ids and target ids
+    QFile file(fileName);
+    writeHeader(file, "I", _rows, _cols, targetSigset, querySigset);
+    const qint32 flags[2] = { partition, pairwise };
+    file.write((const char*)flags, sizeof(flags));
+    file.write((const char*)queryIds.data(), queryIds.size()*sizeof(Ids));
+    file.write((const char*)targetIds.data(), targetIds.size()*sizeof(Ids));
+    file.close();
+}
 
-        for (int j=0; j<targets.size(); j++) {
-            const QString &fileB = targets[j];
-            const QString labelB = targetLabels[j];
-            const int partitionB = targetPartitions[j];
+/* Mask - private methods */
+void Mask::indexLabels()
+{
+    labelTargets.clear();
+    for (int j=0; j<targetIds.size(); j++)
+        if (targetIds[j].label != -1)
+            labelTargets[targetIds[j].label].append(j);
+}
 
-            MaskValue val;
-            if      (fileA == fileB)           val = DontCare;
-            else if (targetOnly)               val = DontCare;
-            else if (labelA == "-1")           val = DontCare;
-            else if (labelB == "-1")           val = DontCare;
-            else if (partitionA != partition)  val = DontCare;
-            else if (partitionB == -1)         val = NonMatch;
-            else if (partitionB != partition)  val = DontCare;
-            else if (labelA == labelB)         val = Match;
-            else                               val = NonMatch;
-            mask.at<MaskValue>(i,j) = val;
-        }
+Mask readMask(const File &mask, QString *targetSigset, QString *querySigset)
+{
+    QFile file(mask);
+    if (!file.open(QFile::ReadOnly))
+        qFatal("Unable to open %s for reading.", qPrintable(mask.name));
+
+    // Check format
+    const QByteArray format = file.readLine();
+    if (format[1] != '2') qFatal("Invalid matrix header.");
+
+    // Read sigsets
+    if (targetSigset != NULL) *targetSigset = file.readLine().simplified();
+    else                      file.readLine();
+    if (querySigset != NULL) *querySigset = file.readLine().simplified();
+    else                     file.readLine();
+
+    const QStringList words = QString(file.readLine()).split(" ");
+    if (words[0][1] != 'I') {
+        file.close();
+        return Mask(readMatrix(mask, targetSigset, querySigset));
     }
 
-    return mask;
+    Mask result;
+    result._rows = words[1].toInt();
+    result._cols = words[2].toInt();
+
+    qint32 flags[2];
+    if (file.read((char*)flags, sizeof(flags)) != sizeof(flags))
+        qFatal("Didn't read complete mask header!");
+    result.partition = flags[0];
+    result.pairwise = flags[1];
+
+    result.queryIds.resize(result._rows);
+    result.targetIds.resize(result.pairwise ? result._rows : result._cols);
+    const qint64 queryBytes = result.queryIds.size()*sizeof(Mask::Ids);
+    const qint64 targetBytes = result.targetIds.size()*sizeof(Mask::Ids);
+    if ((file.read((char*)result.queryIds.data(), queryBytes) != queryBytes) ||
+        (file.read((char*)result.targetIds.data(), targetBytes) != targetBytes))
+        qFatal("Didn't read complete mask ids!");
+    if (!file.atEnd())
+        qFatal("Expected mask end of file.");
+    file.close();
+
+    result.indexLabels();
+    return result;
 }
 
 void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method)
@@ -338,14 +458,18 @@ void combineMasks(const QStringList &inputMasks, const QString &outputMask, cons
     else if (method == "Or")  AND = false;
     else                      qFatal("Invalid method.");
 
-    QList<Mat> masks;
+    QList<Mask> masks;
     foreach (const QString &inputMask, inputMasks)
-        masks.append(readMatrix(inputMask));
+        masks.append(readMask(inputMask));
     if (masks.size() < 2)
         qFatal("Expected at least two masks.");
 
-    const int rows = masks.first().rows;
-    const int columns = masks.first().cols;
+    const int rows = masks.first().rows();
+    const int columns = masks.first().cols();
+    foreach (const Mask &mask, masks)
+        if ((mask.rows() != rows) || (mask.cols() != columns))
+            qFatal("Mask size mismatch.");
+
     Mat combinedMask(rows, columns, CV_8UC1);
     for (int i=0; i<rows; i++) {
         for (int j=0; j<columns; j++) {
@@ -353,7 +477,7 @@ void combineMasks(const QStringList &inputMasks, const QString &outputMask, cons
             int imposterCount = 0;
             int dontcareCount = 0;
             for (int k=0; k<masks.size(); k++) {
-                switch (masks[k].at<MaskValue>(i,j)) {
+                switch (masks[k].at(i,j)) {
                   case Match:
                     genuineCount++;
                     break;
@@ -17,8 +17,10 @@
 #ifndef BEE_BEE_H
 #define BEE_BEE_H
 
+#include <QHash>
 #include <QString>
 #include <QStringList>
+#include <QVector>
 #include <opencv2/core/core.hpp>
 #include <openbr/openbr_plugin.h>
 
@@ -44,6 +46,41 @@ namespace BEE
     void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset);
 
     // Mask
+    // Ground truth for a simmat, either a dense mask matrix or implicitly
+    // defined by per-row (query) and per-column (target) label and partition ids.
+    class Mask
+    {
+    public:
+        Mask() : _rows(0), _cols(0), partition(0), pairwise(false) {}
+        explicit Mask(const cv::Mat &dense);
+        Mask(const br::FileList &targets, const br::FileList &queries, int partition = 0, bool pairwise = false);
+
+        int rows() const { return _rows; }
+        int cols() const { return _cols; }
+        bool isImplicit() const { return dense.empty(); }
+        MaskValue at(int row, int col) const;
+        QList<int> genuines(int row) const; // Match columns of a row, found by label rather than a full scan
+        cv::Mat toMat() const;
+        void write(const QString &fileName, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query") const;
+
+    private:
+        struct Ids
+        {
+            qint32 file, label, partition, targetOnly; // label is -1 when unlabeled
+        };
+
+        int _rows, _cols;
+        cv::Mat dense;
+        qint32 partition;
+        bool pairwise; // Column i of row i, stored as a single column
+        QVector<Ids> queryIds, targetIds;
+        QHash<qint32, QList<int> > labelTargets;
+
+        void indexLabels();
+        friend Mask readMask(const br::File &mask, QString *targetSigset, QString *querySigset);
+    };
+
+    Mask readMask(const br::File &mask, QString *targetSigset = NULL, QString *querySigset = NULL); // Reads dense or implicit masks
     void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     cv::Mat makeMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
     void makePairwiseMask(const QString &targetInput, const QString &queryInput, const QString &mask);
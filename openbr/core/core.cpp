@@ -14,7 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCryptographicHash>
 #include <openbr/openbr_plugin.h>
+#include <algorithm>
 
 #include "bee.h"
 #include "common.h"
@@ -28,6 +30,101 @@ void noDelete(Transform *target)
     (void) target;
 }
 
+// Projects templates through a sequence of transforms one block of Context::blockSize at a time
+class ProjectedBlocks
+{
+    const TemplateList &data;
+    QScopedPointer<Transform> pipe, stream;
+    int index;
+
+public:
+    ProjectedBlocks(const TemplateList &data, QList<Transform*> stages)
+        : data(data), index(0)
+    {
+        if (!stages.isEmpty()) {
+            pipe.reset(pipeTransforms(stages));
+            stream.reset(wrapTransform(pipe.data(), "Stream(readMode=DistributeFrames)"));
+        }
+    }
+
+    bool next(TemplateList &block)
+    {
+        if (index >= data.size())
+            return false;
+        block = data.mid(index, Globals->blockSize);
+        index += block.size();
+        if (stream)
+            stream->projectUpdate(block, block);
+
+        // Failures are dropped, as Pipe does while training
+        for (int i=block.size()-1; i>=0; i--)
+            if (block[i].file.fte)
+                block.removeAt(i);
+        return true;
+    }
+};
+
+// Bounded reservoir sample of a template stream, uniform or stratified by label
+class TrainingSample
+{
+    const int samples, instances;
+    qint64 seen;
+    TemplateList reservoir;
+    QHash<QString, QPair<qint64, TemplateList> > labels; // Templates seen and reservoir per label
+
+    static qint64 random(qint64 n)
+    {
+        return ((qint64(rand()) << 31) ^ rand()) % n;
+    }
+
+    static void add(const Template &t, int capacity, qint64 &seen, TemplateList &reservoir)
+    {
+        seen++;
+        if (reservoir.size() < capacity) {
+            reservoir.append(t);
+        } else {
+            const qint64 i = random(seen);
+            if (i < capacity)
+                reservoir[i] = t;
+        }
+    }
+
+public:
+    TrainingSample(int samples, int instances)
+        : samples(samples), instances(instances), seen(0)
+    {
+        Common::seedRNG();
+    }
+
+    void add(const TemplateList &block)
+    {
+        foreach (const Template &t, block) {
+            if (instances > 0) {
+                QPair<qint64, TemplateList> &label = labels[t.file.get<QString>("Label", "")];
+                add(t, instances, label.first, label.second);
+            } else {
+                add(t, samples, seen, reservoir);
+            }
+        }
+    }
+
+    TemplateList take()
+    {
+        TemplateList sample;
+        if (instances > 0) {
+            foreach (const QString &label, labels.keys())
+                sample.append(labels.take(label).second);
+            if (sample.size() > samples) {
+                std::random_shuffle(sample.begin(), sample.end());
+                sample = sample.mid(0, samples);
+            }
+        } else {
+            sample.swap(reservoir);
+        }
+        return sample;
+    }
+};
+
 struct AlgorithmCore
 {
     enum CompareMode
@@ -74,18 +171,22 @@ struct AlgorithmCore
 
         Globals->startTime.start();
 
-        qDebug("Training Enrollment");
-        trainingWrapper->train(data);
+        if (Globals->trainingSamples > 0) {
+            trainStreaming(data);
+        } else {
+            qDebug("Training Enrollment");
+            trainingWrapper->train(data);
 
-        if (!distance.isNull()) {
-            if (Globals->crossValidate > 0)
-                for (int i=data.size()-1; i>=0; i--) if (data[i].file.get<bool>("allPartitions",false)) data.removeAt(i);
+            if (!distance.isNull()) {
+                if (Globals->crossValidate > 0)
+                    for (int i=data.size()-1; i>=0; i--) if (data[i].file.get<bool>("allPartitions",false)) data.removeAt(i);
 
-            qDebug("Projecting Enrollment");
-            trainingWrapper->projectUpdate(data,data);
+                qDebug("Projecting Enrollment");
+                trainingWrapper->projectUpdate(data,data);
 
-            qDebug("Training Comparison");
-            distance->train(data);
+                qDebug("Training Comparison");
+                distance->train(data);
+            }
         }
 
         if (!model.isEmpty()) {
@@ -98,6 +199,61 @@ struct AlgorithmCore
         simplifyTransform();
     }
 
+    // Trains each stage of the algorithm on data streamed through the stages before it,
+    // decoding on demand so memory is bounded by Context::trainingSamples rather than the gallery size.
+    void trainStreaming(TemplateList &data)
+    {
+        QList<Transform*> stages;
+        CompositeTransform *pipe = dynamic_cast<CompositeTransform*>(transform.data());
+        if (pipe && (transform->objectName() == "Pipe")) stages = pipe->transforms;
+        else                                             stages.append(transform.data());
+
+        for (int i=0; i<stages.size(); i++) {
+            if (!stages[i]->trainable)
+                continue;
+
+            qDebug("Training %s", qPrintable(stages[i]->objectName()));
+            if (stages[i]->incrementalTraining()) {
+                bool first = true;
+                for (int epoch=0; epoch<Globals->trainingEpochs; epoch++) {
+                    ProjectedBlocks blocks(data, stages.mid(0, i));
+                    TemplateList block;
+                    while (blocks.next(block)) {
+                        if (block.isEmpty()) continue;
+                        stages[i]->trainBlock(block, first);
+                        first = false;
+                    }
+                }
+            } else {
+                // Mirror the per-template structure Stream uses when training
+                QList<TemplateList> separated;
+                foreach (const Template &t, sample(data, stages.mid(0, i))) {
+                    separated.append(TemplateList());
+                    separated.last().append(t);
+                }
+                stages[i]->train(separated);
+            }
+        }
+
+        if (!distance.isNull()) {
+            if (Globals->crossValidate > 0)
+                for (int i=data.size()-1; i>=0; i--) if (data[i].file.get<bool>("allPartitions",false)) data.removeAt(i);
+
+            qDebug("Training Comparison");
+            distance->train(sample(data, stages));
+        }
+    }
+
+    static TemplateList sample(const TemplateList &data, const QList<Transform*> &stages)
+    {
+        TrainingSample sample(Globals->trainingSamples, Globals->trainingInstances);
+        ProjectedBlocks blocks(data, stages);
+        TemplateList block;
+        while (blocks.next(block))
+            sample.add(block);
+        return sample.take();
+    }
+
     void simplifyTransform()
     {
         bool newTForm = false;
@@ -633,6 +789,159 @@ void br::Enroll(const File &input, const File &gallery)
     AlgorithmManager::getAlgorithm(gallery.get<QString>("algorithm"))->enroll(input, gallery);
 }
 
+// Prefix tree of the enrollment stages of several algorithms, stages shared by algorithms are run once
+class EnrollmentTree
+{
+    struct Node
+    {
+        Transform *stage; // NULL for the root
+        QSharedPointer<Transform> stream; // Distributes the stage's templates across threads
+        QString key;
+        QList<int> children;
+        QList<int> galleries; // Outputs of algorithms ending at this node
+
+        Node() : stage(NULL) {}
+    };
+
+    QList<Node> nodes;
+    QList< QSharedPointer<AlgorithmCore> > algorithms; // Keep the stages alive
+    QList< QSharedPointer<Gallery> > outputs;
+    QList< QSharedPointer<Transform> > exclusions; // Non-null for append galleries that already exist
+    QSharedPointer<Transform> progressCounter;
+
+    static QList<Transform*> stages(Transform *transform)
+    {
+        QList<Transform*> stages;
+        CompositeTransform *pipe = dynamic_cast<CompositeTransform*>(transform);
+        if (pipe && (transform->objectName() == "Pipe")) stages = pipe->transforms;
+        else                                             stages.append(transform);
+        return stages;
+    }
+
+    // Stages match when both their definitions and their trained state do
+    static QString key(const Transform *stage)
+    {
+        QByteArray state;
+        QDataStream stream(&state, QFile::WriteOnly);
+        stage->store(stream);
+        return stage->description(true) + ":" + QCryptographicHash::hash(state, QCryptographicHash::Md5).toHex();
+    }
+
+    int child(int parent, Transform *stage)
+    {
+        const QString stageKey = key(stage);
+        foreach (int c, nodes[parent].children)
+            if (nodes[c].key == stageKey)
+                return c;
+
+        Node node;
+        node.stage = stage;
+        node.stream = QSharedPointer<Transform>(wrapTransform(stage, "Stream(readMode=DistributeFrames)"));
+        node.key = stageKey;
+        nodes.append(node);
+        nodes[parent].children.append(nodes.size()-1);
+        return nodes.size()-1;
+    }
+
+    // Like Pipe, failures to enroll skip the remaining stages and are appended to the output
+    void project(int n, const TemplateList &data, TemplateList ftes)
+    {
+        TemplateList projected;
+        nodes[n].stream->projectUpdate(data, projected);
+        splitFTEs(projected, ftes);
+        propagate(n, projected, ftes);
+    }
+
+    void propagate(int n, const TemplateList &data, const TemplateList &ftes)
+    {
+        foreach (int gallery, nodes[n].galleries) {
+            TemplateList written = data;
+            written.append(ftes);
+            if (exclusions[gallery])
+                exclusions[gallery]->projectUpdate(written, written);
+            if (!written.isEmpty())
+                outputs[gallery]->writeBlock(written);
+        }
+
+        foreach (int c, nodes[n].children)
+            project(c, data, ftes);
+    }
+
+    void finalize(int n)
+    {
+        foreach (int c, nodes[n].children) {
+            TemplateList last;
+            nodes[c].stream->finalize(last);
+            if (!last.isEmpty())
+                propagate(c, last, TemplateList());
+            finalize(c);
+        }
+    }
+
+public:
+    EnrollmentTree(const QList<File> &galleries)
+    {
+        // ProcessWrapper runs a whole algorithm in a child process, which can't share stages with the others
+        if (Globals->file.getBool("multiProcess", false))
+            qFatal("multiProcess is not supported when enrolling to several galleries.");
+
+        nodes.append(Node());
+        progressCounter = QSharedPointer<Transform>(Transform::make("ProgressCounter", NULL));
+
+        int total = 0, shared = 0;
+        for (int i=0; i<galleries.size(); i++) {
+            // In append mode, we will exclude any templates with filenames already present in the output gallery
+            if (galleries[i].contains("append") && galleries[i].exists()) {
+                FileList::fromGallery(galleries[i], true);
+                exclusions.append(QSharedPointer<Transform>(Transform::make("FileExclusion(" + galleries[i].flat() + ")", NULL)));
+            } else {
+                exclusions.append(QSharedPointer<Transform>());
+            }
+
+            algorithms.append(AlgorithmManager::getAlgorithm(galleries[i].get<QString>("algorithm")));
+            outputs.append(QSharedPointer<Gallery>(Gallery::make(galleries[i])));
+
+            int node = 0;
+            foreach (Transform *stage, stages(algorithms.last()->simplifiedTransform.data())) {
+                const int existing = nodes.size();
+                node = child(node, stage);
+                if (node < existing) shared++;
+                total++;
+            }
+            nodes[node].galleries.append(i);
+        }
+        qDebug("Enrolling %d algorithms, %d of %d stages shared", galleries.size(), shared, total);
+    }
+
+    void enroll(const File &input)
+    {
+        QScopedPointer<Gallery> inputGallery(Gallery::make(input));
+        progressCounter->setPropertyRecursive("totalProgress", QString::number(inputGallery->totalSize()));
+
+        // Small blocks, as StreamGallery reads, bound the templates held in every stage at once
+        inputGallery->readBlockSize = 100;
+        bool done;
+        do {
+            TemplateList templates = inputGallery->readBlock(&done);
+            if (!templates.empty()) {
+                propagate(0, templates, TemplateList());
+                progressCounter->projectUpdate(templates, templates);
+            }
+        } while (!done);
+        finalize(0);
+
+        TemplateList last;
+        progressCounter->finalize(last);
+    }
+};
+
+void br::Enroll(const File &input, const QList<File> &galleries)
+{
+    qDebug("Enrolling %s to %d galleries", qPrintable(input.flat()), galleries.size());
+    EnrollmentTree tree(galleries);
+    tree.enroll(input);
+}
+
 void br::Project(const File &input, const File &output)
 {
     return AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->project(input, output);
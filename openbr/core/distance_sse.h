@@ -72,4 +72,81 @@ inline float packed_l1(const uchar *a, const uchar *b, int size)
     return distance;
 }
 
+// Signed 8-bit dot product, elements must lie in [-127, 127] so the
+// |a| * sign(b, a) multiply-accumulate below can't saturate.
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+// VNNI fuses the multiply, widen and accumulate, AVX512-VL and AVX-VNNI both provide a 256-bit form
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+#define BR_DPBUSD _mm256_dpbusd_epi32
+#elif defined(__AVXVNNI__)
+#define BR_DPBUSD _mm256_dpbusd_avx_epi32
+#endif
+
+inline int dot_s8(const signed char *a, const signed char *b, int size)
+{
+    __m256i accumulate = _mm256_setzero_si256();
+#ifndef BR_DPBUSD
+    const __m256i ones = _mm256_set1_epi16(1);
+#endif
+
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i));
+        const __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i));
+#ifdef BR_DPBUSD
+        accumulate = BR_DPBUSD(accumulate, _mm256_abs_epi8(A), _mm256_sign_epi8(B, A));
+#else
+        const __m256i products = _mm256_maddubs_epi16(_mm256_abs_epi8(A), _mm256_sign_epi8(B, A));
+        accumulate = _mm256_add_epi32(accumulate, _mm256_madd_epi16(products, ones));
+#endif
+    }
+
+    int buff[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    int dot = buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7];
+    for (; i<size; i++)
+        dot += a[i] * b[i];
+    return dot;
+}
+
+#elif defined(__SSSE3__)
+
+#include <tmmintrin.h>
+
+inline int dot_s8(const signed char *a, const signed char *b, int size)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i accumulate = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i));
+        const __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i));
+        const __m128i products = _mm_maddubs_epi16(_mm_abs_epi8(A), _mm_sign_epi8(B, A));
+        accumulate = _mm_add_epi32(accumulate, _mm_madd_epi16(products, ones));
+    }
+
+    int buff[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    int dot = buff[0] + buff[1] + buff[2] + buff[3];
+    for (; i<size; i++)
+        dot += a[i] * b[i];
+    return dot;
+}
+
+#else
+
+inline int dot_s8(const signed char *a, const signed char *b, int size)
+{
+    int dot = 0;
+    for (int i=0; i<size; i++)
+        dot += a[i] * b[i];
+    return dot;
+}
+
+#endif
+
 #endif // DISTANCE_SSE_H
@@ -83,23 +83,23 @@ static float getCMC(const QVector<int> &firstGenuineReturns, int rank)
     return retrievalRate;
 }
 
-// Decide whether to construct a normal mask matrix, or a pairwise mask by comparing the dimensions of
+// Decide whether to construct a normal mask, or a pairwise mask by comparing the dimensions of
 // scores with the size of the target and query lists
-static cv::Mat constructMatchingMask(const cv::Mat &scores, const FileList &target, const FileList &query, int partition=0)
+static BEE::Mask constructMatchingMask(const cv::Mat &scores, const FileList &target, const FileList &query, int partition=0)
 {
-    // If the dimensions of the score matrix match the sizes of the target and query lists, construct a normal mask matrix
+    // If the dimensions of the score matrix match the sizes of the target and query lists, construct a normal mask
     if (target.size() == scores.cols && query.size() == scores.rows)
-        return BEE::makeMask(target, query, partition);
+        return BEE::Mask(target, query, partition);
     // If this looks like a pairwise comparison (1 column score matrix, equal length target and query sets), construct a
     // mask for that
     else if (scores.cols == 1 && target.size() == query.size()) {
-        return BEE::makePairwiseMask(target, query, partition);
+        return BEE::Mask(target, query, partition, true);
     }
     // otherwise, we fail
     else
         qFatal("Unable to construct mask for %d by %d score matrix from %d element query set, and %d element target set ", scores.rows, scores.cols, query.length(), target.length());
 
-    return cv::Mat();
+    return BEE::Mask();
 }
 
 float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const QString &csv, int partition)
@@ -124,8 +124,8 @@ float Evaluate(const QString &simmat, const QString &mask, const QString &csv, u
         scores = format->read();
     }
 
-    // Read mask matrix
-    Mat truth;
+    // Read mask
+    BEE::Mask truth;
     if (mask.isEmpty()) {
         // Use the galleries specified in the similarity matrix
         if (target.isEmpty()) qFatal("Unspecified target gallery.");
@@ -133,38 +133,50 @@ float Evaluate(const QString &simmat, const QString &mask, const QString &csv, u
 
         truth = constructMatchingMask(scores, TemplateList::fromGallery(target).files(),
                                               TemplateList::fromGallery(query).files());
+    } else if ((File(mask).suffix() == "mask") || (File(mask).suffix() == "mtx")) {
+        truth = BEE::readMask(mask);
     } else {
         File maskFile(mask);
         maskFile.set("rows", scores.rows);
         maskFile.set("columns", scores.cols);
         QScopedPointer<Format> format(Factory<Format>::make(maskFile));
-        truth = format->read();
+        truth = BEE::Mask(format->read());
     }
 
     return Evaluate(scores, truth, csv, target, query, matches);
 }
 
 float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv, const QString &target, const QString &query, unsigned int matches)
+{
+    return Evaluate(simmat, BEE::Mask(mask), csv, target, query, matches);
+}
+
+float Evaluate(const Mat &simmat, const BEE::Mask &mask, const QString &csv, const QString &target, const QString &query, unsigned int matches)
 {
     if (target.isEmpty() || query.isEmpty()) matches = 0;
-    if (simmat.size() != mask.size())
+    if ((simmat.rows != mask.rows()) || (simmat.cols != mask.cols()))
         qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).",
-               simmat.rows, simmat.cols, mask.rows, mask.cols);
+               simmat.rows, simmat.cols, mask.rows(), mask.cols());
 
     if (simmat.type() != CV_32FC1)
         qFatal("Invalid simmat format");
 
-    if (mask.type() != CV_8UC1)
-        qFatal("Invalid mask format");
-
     float result = -1;
 
+    // Implicit masks enumerate genuine pairs by label, so a probe set without any fails before the full scan
+    int expectedGenuines = 0;
+    if (mask.isImplicit()) {
+        for (int i=0; i<mask.rows(); i++)
+            expectedGenuines += mask.genuines(i).size();
+        if (expectedGenuines == 0) qFatal("No genuine scores!");
+    }
+
     // Make comparisons
     QList<Comparison> comparisons; comparisons.reserve(simmat.rows*simmat.cols);
     int genuineCount = 0, impostorCount = 0, numNaNs = 0;
     for (int i=0; i<simmat.rows; i++) {
         for (int j=0; j<simmat.cols; j++) {
-            const BEE::MaskValue mask_val = mask.at<BEE::MaskValue>(i,j);
+            const BEE::MaskValue mask_val = mask.at(i,j);
             const BEE::SimmatValue simmat_val = simmat.at<BEE::SimmatValue>(i,j);
             if (mask_val == BEE::DontCare) continue;
             if (simmat_val != simmat_val) { numNaNs++; continue; }
@@ -186,7 +198,7 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv, const QSt
     std::sort(comparisons.begin(), comparisons.end());
 
     QList<OperatingPoint> operatingPoints;
-    QList<float> genuines; genuines.reserve(sqrt((float)comparisons.size()));
+    QList<float> genuines; genuines.reserve(mask.isImplicit() ? expectedGenuines : sqrt((float)comparisons.size()));
     QList<float> impostors; impostors.reserve(comparisons.size());
     QVector<int> firstGenuineReturns(simmat.rows, 0);
 
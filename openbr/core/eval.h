@@ -20,12 +20,14 @@
 #include <QList>
 #include <QString>
 #include "openbr/openbr_plugin.h"
+#include "openbr/core/bee.h"
 
 namespace br
 {
     float Evaluate(const QString &simmat, const QString &mask = "", const QString &csv = "", unsigned int matches = 0); // Returns TAR @ FAR = 0.001
     float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const QString &csv = "", int parition = 0);
     float Evaluate(const cv::Mat &scores, const cv::Mat &masks, const QString &csv = "", const QString &target = "", const QString &query = "", unsigned int matches = 0);
+    float Evaluate(const cv::Mat &scores, const BEE::Mask &mask, const QString &csv = "", const QString &target = "", const QString &query = "", unsigned int matches = 0);
     void assertEval(const QString &simmat, const QString &mask, float accuracy); // Check to see if -eval achieves a given TAR @ FAR = 0.001
     float InplaceEval(const QString & simmat, const QString & target, const QString & query, const QString & csv = "");
 
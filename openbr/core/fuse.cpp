@@ -28,10 +28,10 @@
 
 using namespace cv;
 
-static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
+static void normalizeMatrix(Mat &matrix, const BEE::Mask &mask, const QString &method)
 {
-    if (matrix.rows != mask.rows && matrix.cols != mask.cols)
-        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
+    if (matrix.rows != mask.rows() && matrix.cols != mask.cols())
+        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows(), mask.cols());
 
     if (method == "None") return;
 
@@ -39,7 +39,7 @@ static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
     for (int i=0; i<matrix.rows; i++) {
         for (int j=0; j<matrix.cols; j++) {
             float val = matrix.at<float>(i,j);
-            if ((mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) ||
+            if ((mask.at(i,j) == BEE::DontCare) ||
                 (val == -std::numeric_limits<float>::max()) ||
                 (val ==  std::numeric_limits<float>::max()))
                 continue;
@@ -55,7 +55,7 @@ static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
     if (method == "MinMax") {
         for (int i=0; i<matrix.rows; i++) {
             for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
+                if (mask.at(i,j) == BEE::DontCare) continue;
                 float &val = matrix.at<float>(i,j);
                 if      (val == -std::numeric_limits<float>::max()) val = 0;
                 else if (val ==  std::numeric_limits<float>::max()) val = 1;
@@ -66,7 +66,7 @@ static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
         if (stddev == 0) qFatal("Stddev is 0.");
         for (int i=0; i<matrix.rows; i++) {
             for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
+                if (mask.at(i,j) == BEE::DontCare) continue;
                 float &val = matrix.at<float>(i,j);
                 if      (val == -std::numeric_limits<float>::max()) val = (min - mean) / stddev;
                 else if (val ==  std::numeric_limits<float>::max()) val = (max - mean) / stddev;
@@ -107,7 +107,7 @@ void br::Fuse(const QStringList &inputSimmats, const QString &normalization, con
         foreach (const Mat& matrix, originalMatrices)
             matrices.append(matrix.clone());
 
-        Mat matrix_mask = BEE::makeMask(targetFiles,queryFiles,partition);
+        const BEE::Mask matrix_mask(targetFiles,queryFiles,partition);
         for (int i=0; i<matrices.size(); i++)
             normalizeMatrix(matrices[i], matrix_mask, normalization);
 
@@ -143,7 +143,10 @@ void br::Fuse(const QStringList &inputSimmats, const QString &normalization, con
         } else if (fusion == "Replace") {
             if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
             fused = matrices.first().clone();
-            matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
+            for (int i=0; i<fused.rows; i++)
+                for (int j=0; j<fused.cols; j++)
+                    if (matrix_mask.at(i,j) != BEE::DontCare)
+                        fused.at<float>(i,j) = matrices.last().at<float>(i,j);
         } else if (fusion == "Difference") {
             if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
             subtract(matrices[0], matrices[1], fused);
@@ -154,10 +157,10 @@ void br::Fuse(const QStringList &inputSimmats, const QString &normalization, con
         }
 
         // We don't want to add scores where the mask says we shouldn't care
-        Mat buffer_mask = Mat::ones(matrix_mask.size(),CV_8UC1);
-        buffer_mask.setTo(0,matrix_mask==BEE::DontCare);
-
-        add(buffer,fused,buffer,buffer_mask);
+        for (int i=0; i<buffer.rows; i++)
+            for (int j=0; j<buffer.cols; j++)
+                if (matrix_mask.at(i,j) != BEE::DontCare)
+                    buffer.at<float>(i,j) += fused.at<float>(i,j);
 
         partition++;
 
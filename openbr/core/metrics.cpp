@@ -0,0 +1,241 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QFile>
+#include <QMap>
+#include <QStringList>
+#include <QThread>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <openbr/openbr_plugin.h>
+#include <algorithm>
+#include <cmath>
+
+#include "metrics.h"
+#include "qtutils.h"
+
+using namespace br;
+
+static QString formatValue(double value)
+{
+    return QString::number(value, 'g', 12);
+}
+
+// Inserts extra labels into a possibly labelled metric name
+static QString withLabels(const QString &name, const QString &suffix, const QString &labels)
+{
+    const int brace = name.indexOf('{');
+    if (brace == -1)
+        return name + suffix + (labels.isEmpty() ? QString() : "{" + labels + "}");
+    const QString existing = name.mid(brace+1, name.size()-brace-2);
+    return name.left(brace) + suffix + "{" + existing + (labels.isEmpty() ? QString() : "," + labels) + "}";
+}
+
+static QString family(const QString &name)
+{
+    const int brace = name.indexOf('{');
+    return brace == -1 ? name : name.left(brace);
+}
+
+/* Metric - public methods */
+Metric::Metric(const QString &name, Type type)
+    : _name(name), _type(type), value(0), count(0)
+{
+    if (type == Histogram)
+        buckets = QVector<qint64>(bounds().size() + 1, 0);
+}
+
+void Metric::add(double delta)
+{
+    QMutexLocker locker(&lock);
+    value += delta;
+}
+
+void Metric::set(double newValue)
+{
+    QMutexLocker locker(&lock);
+    value = newValue;
+}
+
+void Metric::observe(double seconds)
+{
+    const QVector<double> &b = bounds();
+    const int bucket = std::lower_bound(b.begin(), b.end(), seconds) - b.begin();
+
+    QMutexLocker locker(&lock);
+    buckets[bucket]++;
+    value += seconds;
+    count++;
+}
+
+QString Metric::toText() const
+{
+    QMutexLocker locker(&lock);
+    if (_type != Histogram)
+        return _name + " " + formatValue(value) + "\n";
+
+    QString text;
+    const QVector<double> &b = bounds();
+    qint64 cumulative = 0;
+    for (int i=0; i<b.size(); i++) {
+        cumulative += buckets[i];
+        text += withLabels(_name, "_bucket", "le=\"" + formatValue(b[i]) + "\"") + " " + QString::number(cumulative) + "\n";
+    }
+    text += withLabels(_name, "_bucket", "le=\"+Inf\"") + " " + QString::number(count) + "\n";
+    text += withLabels(_name, "_sum", QString()) + " " + formatValue(value) + "\n";
+    text += withLabels(_name, "_count", QString()) + " " + QString::number(count) + "\n";
+    return text;
+}
+
+static QVector<double> makeBounds()
+{
+    // 100us to 100s in steps of sqrt(10), enough resolution for percentile estimates
+    QVector<double> b;
+    for (int i=-8; i<=4; i++)
+        b.append(std::pow(10.0, i/2.0));
+    return b;
+}
+
+const QVector<double> &Metric::bounds()
+{
+    static const QVector<double> b = makeBounds();
+    return b;
+}
+
+/* Metrics - public methods */
+// Intentionally leaked so metrics stay valid during static destruction
+static QMutex &registryLock()
+{
+    static QMutex *lock = new QMutex();
+    return *lock;
+}
+
+static QMap<QString, Metric*> &registry()
+{
+    static QMap<QString, Metric*> *metrics = new QMap<QString, Metric*>();
+    return *metrics;
+}
+
+Metric *Metrics::get(const QString &name, Metric::Type type)
+{
+    QMutexLocker locker(&registryLock());
+    Metric *&metric = registry()[name];
+    if (metric == NULL)
+        metric = new Metric(name, type);
+    else if (metric->type() != type)
+        qFatal("Metric %s registered with conflicting types.", qPrintable(name));
+    return metric;
+}
+
+QString Metrics::toText()
+{
+    const QThreadPool *pool = QThreadPool::globalInstance();
+    gauge("br_thread_pool_active_threads")->set(pool->activeThreadCount());
+    gauge("br_thread_pool_max_threads")->set(pool->maxThreadCount());
+    gauge("br_thread_pool_utilization")->set(double(pool->activeThreadCount()) / qMax(1, pool->maxThreadCount()));
+    gauge("br_progress")->set(Globals->progress());
+
+    QList<Metric*> metrics;
+    {
+        QMutexLocker locker(&registryLock());
+        metrics = registry().values(); // Sorted by name, so families are contiguous
+    }
+
+    static const char *typeNames[] = { "counter", "gauge", "histogram" };
+    QString text, previousFamily;
+    foreach (const Metric *metric, metrics) {
+        const QString currentFamily = family(metric->name());
+        if (currentFamily != previousFamily) {
+            text += "# TYPE " + currentFamily + " " + typeNames[metric->type()] + "\n";
+            previousFamily = currentFamily;
+        }
+        text += metric->toText();
+    }
+    return text;
+}
+
+void Metrics::write(const QString &fileName)
+{
+    // Write to a temporary file and rename so scrapers never see a partial dump
+    const QString temporary = fileName + ".tmp";
+    QtUtils::writeFile(temporary, toText().toUtf8());
+    QFile::remove(fileName);
+    if (!QFile::rename(temporary, fileName))
+        qWarning("Failed to write metrics to %s", qPrintable(fileName));
+}
+
+// Writes the metrics file once a second until stopped, finalize() wakes it instead of waiting out the second
+class MetricsWriter : public QThread
+{
+    QMutex lock;
+    QWaitCondition wake;
+    QString fileName;
+    bool stopping;
+
+public:
+    MetricsWriter(const QString &fileName) : fileName(fileName), stopping(false) {}
+
+    void setFileName(const QString &newFileName)
+    {
+        QMutexLocker locker(&lock);
+        fileName = newFileName;
+    }
+
+    void stop()
+    {
+        {
+            QMutexLocker locker(&lock);
+            stopping = true;
+            wake.wakeAll();
+        }
+        wait();
+    }
+
+private:
+    void run()
+    {
+        QMutexLocker locker(&lock);
+        while (!stopping) {
+            wake.wait(&lock, 1000);
+            if (stopping)
+                return;
+            const QString current = fileName;
+            locker.unlock();
+            Metrics::write(current);
+            locker.relock();
+        }
+    }
+};
+
+static MetricsWriter *writer = NULL;
+static QMutex writerLock;
+
+void Metrics::setOutput(const QString &fileName)
+{
+    QMutexLocker locker(&writerLock);
+    if (fileName.isEmpty()) {
+        if (writer) {
+            writer->stop();
+            delete writer;
+            writer = NULL;
+        }
+    } else if (writer) {
+        writer->setFileName(fileName);
+    } else {
+        writer = new MetricsWriter(fileName);
+        writer->start(QThread::LowestPriority);
+    }
+}
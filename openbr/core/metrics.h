@@ -0,0 +1,87 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_METRICS_H
+#define BR_METRICS_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+namespace br
+{
+
+// A single named counter, gauge or latency histogram.
+// Names may carry Prometheus labels, e.g. br_stage_frames_total{stage="1"}.
+// Metrics are owned by Metrics and live until the process exits, so callers
+// on hot paths should look them up once and keep the pointer.
+class Metric
+{
+public:
+    enum Type { Counter, Gauge, Histogram };
+
+    Metric(const QString &name, Type type);
+
+    void add(double value = 1);        // Counter or Gauge
+    void set(double value);            // Gauge
+    void observe(double seconds);      // Histogram
+
+    QString name() const { return _name; }
+    Type type() const { return _type; }
+    QString toText() const;
+
+    static const QVector<double> &bounds(); // Histogram bucket upper bounds, in seconds
+
+private:
+    mutable QMutex lock;
+    const QString _name;
+    const Type _type;
+    double value;             // Counter/Gauge value, Histogram sum
+    qint64 count;             // Histogram observations
+    QVector<qint64> buckets;  // Histogram per-bucket (non-cumulative) counts
+};
+
+// Process-wide registry rendered in the Prometheus text exposition format.
+class Metrics
+{
+public:
+    static Metric *counter(const QString &name) { return get(name, Metric::Counter); }
+    static Metric *gauge(const QString &name) { return get(name, Metric::Gauge); }
+    static Metric *histogram(const QString &name) { return get(name, Metric::Histogram); }
+
+    static QString toText(); // Also samples process-wide gauges like thread pool utilization
+    static void write(const QString &fileName); // Atomically replace fileName with toText()
+    static void setOutput(const QString &fileName); // write() to fileName once a second from a background thread, empty stops it
+
+private:
+    static Metric *get(const QString &name, Metric::Type type);
+};
+
+// Observes the lifetime of the scope into a histogram.
+class MetricTimer
+{
+    Metric *metric;
+    QElapsedTimer timer;
+
+public:
+    explicit MetricTimer(Metric *metric) : metric(metric) { timer.start(); }
+    ~MetricTimer() { if (metric) metric->observe(timer.nsecsElapsed() / 1e9); }
+};
+
+} // namespace br
+
+#endif // BR_METRICS_H
@@ -0,0 +1,174 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDir>
+#include <QFile>
+#include <QFutureSynchronizer>
+#include <QStringList>
+#include <QVector>
+#include <QtConcurrent>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif // __linux__
+
+#include "numa.h"
+
+using namespace br;
+
+static bool nodeLessThan(const QString &a, const QString &b)
+{
+    return a.mid(4).toInt() < b.mid(4).toInt();
+}
+
+// CPU lists of the nodes that have CPUs, in node order
+static QList< QList<int> > readTopology()
+{
+    QList< QList<int> > topology;
+#ifdef __linux__
+    const QDir dir("/sys/devices/system/node");
+    QStringList nodes = dir.entryList(QStringList() << "node[0-9]*", QDir::Dirs);
+    std::sort(nodes.begin(), nodes.end(), nodeLessThan);
+    foreach (const QString &node, nodes) {
+        QFile file(dir.filePath(node + "/cpulist"));
+        if (!file.open(QFile::ReadOnly))
+            continue;
+
+        // Formatted like "0-7,16-23"
+        QList<int> cpus;
+        foreach (const QString &range, QString(file.readAll()).trimmed().split(',', QString::SkipEmptyParts)) {
+            const QStringList bounds = range.split('-');
+            for (int cpu=bounds.first().toInt(); cpu<=bounds.last().toInt(); cpu++)
+                cpus.append(cpu);
+        }
+
+        // Memory-only nodes can't run workers
+        if (!cpus.isEmpty())
+            topology.append(cpus);
+    }
+#endif // __linux__
+    return topology;
+}
+
+static const QList< QList<int> > &topology()
+{
+    static const QList< QList<int> > nodes = readTopology();
+    return nodes;
+}
+
+int Numa::nodes()
+{
+    return std::max(1, topology().size());
+}
+
+QList<int> Numa::cpus(int node)
+{
+    return (topology().size() > 1) ? topology()[node % topology().size()] : QList<int>();
+}
+
+NumaBinding::NumaBinding(int node)
+    : bound(false)
+{
+#ifdef __linux__
+    const QList<int> cpus = Numa::cpus(node);
+    if (cpus.isEmpty())
+        return;
+
+    cpu_set_t current;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &current) != 0)
+        return;
+    previous = QByteArray((const char*) &current, sizeof(cpu_set_t));
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    foreach (int cpu, cpus)
+        CPU_SET(cpu, &mask);
+    bound = (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &mask) == 0);
+#else // !__linux__
+    (void) node;
+#endif // __linux__
+}
+
+NumaBinding::~NumaBinding()
+{
+#ifdef __linux__
+    if (bound)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), (const cpu_set_t*) previous.constData());
+#endif // __linux__
+}
+
+// Deep copies a shard from a thread bound to the node, so its pages are first touched there
+static void localize(const TemplateList &shard, TemplateList *local, int node)
+{
+    NumaBinding binding(node);
+    local->reserve(shard.size());
+    foreach (const Template &t, shard) {
+        Template copy(t.file);
+        foreach (const cv::Mat &m, t)
+            copy.append(m.clone());
+        local->append(copy);
+    }
+}
+
+static void compareShard(const Distance *distance, const TemplateList *shard, const Template *query, QList<float> *scores, int node)
+{
+    NumaBinding binding(node);
+    *scores = distance->compare(*shard, *query);
+}
+
+/* NumaGallery - public methods */
+void NumaGallery::place(const TemplateList &templates)
+{
+    shards.clear();
+    const int nodes = Numa::nodes();
+    if ((nodes < 2) || (templates.size() < nodes))
+        return;
+
+    QVector<TemplateList> local(nodes);
+    QFutureSynchronizer<void> futures;
+    for (int node=0; node<nodes; node++) {
+        const int begin = qint64(templates.size()) * node / nodes;
+        const int end = qint64(templates.size()) * (node+1) / nodes;
+        futures.addFuture(QtConcurrent::run(localize, TemplateList(templates.mid(begin, end-begin)), &local[node], node));
+    }
+    futures.waitForFinished();
+    shards = local.toList();
+}
+
+TemplateList NumaGallery::templates() const
+{
+    TemplateList result;
+    foreach (const TemplateList &shard, shards)
+        result.append(shard);
+    return result;
+}
+
+QList<float> NumaGallery::compare(const Distance *distance, const Template &query) const
+{
+    // Callers already run queries in parallel, so one task per node keeps every node busy
+    QVector< QList<float> > scores(shards.size());
+    QFutureSynchronizer<void> futures;
+    for (int node=0; node<shards.size(); node++)
+        futures.addFuture(QtConcurrent::run(compareShard, distance, &shards[node], &query, &scores[node], node));
+    futures.waitForFinished();
+
+    QList<float> result;
+    foreach (const QList<float> &shardScores, scores)
+        result.append(shardScores);
+    return result;
+}
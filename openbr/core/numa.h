@@ -0,0 +1,63 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_NUMA_H
+#define BR_NUMA_H
+
+#include <QByteArray>
+#include <QList>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// NUMA topology of the machine, read once from sysfs.
+// Platforms without NUMA support report a single node.
+namespace Numa
+{
+    int nodes();
+    QList<int> cpus(int node); // CPUs of a node, empty on single node machines
+}
+
+// Restricts the calling thread to the CPUs of a node for the lifetime of the scope,
+// so memory it first touches is placed on that node. Does nothing on single node machines.
+class NumaBinding
+{
+    bool bound;
+    QByteArray previous; // Affinity mask to restore
+
+public:
+    explicit NumaBinding(int node);
+    ~NumaBinding();
+};
+
+// A gallery split into one contiguous shard per node, each copied once by a thread bound to its node.
+// Comparisons against a shard run on that node's CPUs. Empty on single node machines.
+class NumaGallery
+{
+    QList<TemplateList> shards;
+
+public:
+    void place(const TemplateList &templates);
+    void clear() { shards.clear(); }
+    bool isEmpty() const { return shards.isEmpty(); }
+    TemplateList templates() const; // The placed copies in gallery order, sharing their node-local matrices
+    QList<float> compare(const Distance *distance, const Template &query) const; // Scores in gallery order
+};
+
+} // namespace br
+
+#endif // BR_NUMA_H
@@ -14,4 +14,15 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QThreadStorage>
 #include "resource.h"
+
+static QAtomicInt nextThreadIndex;
+
+int br::resourceThreadIndex()
+{
+    static QThreadStorage<int> index;
+    if (!index.hasLocalData())
+        index.setLocalData(nextThreadIndex.fetchAndAddRelaxed(1));
+    return index.localData();
+}
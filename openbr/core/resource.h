@@ -17,14 +17,17 @@
 #ifndef BR_RESOURCE_H
 #define BR_RESOURCE_H
 
+#include <QAtomicInt>
+#include <QAtomicPointer>
 #include <QHash>
 #include <QList>
 #include <QMutex>
-#include <QSemaphore>
 #include <QSharedPointer>
 #include <QString>
 #include <QThread>
+#include <QWaitCondition>
 #include <openbr/openbr_plugin.h>
+#include <openbr/core/metrics.h>
 
 namespace br
 {
@@ -43,60 +46,201 @@ class DefaultResourceMaker : public ResourceMaker<T>
     T *make() const { return new T(); }
 };
 
+// Small dense index for the calling thread, assigned on first use.
+int resourceThreadIndex();
+
 // Manage multiple copies of a limited resource in a thread-safe manner.
 // TimeVaryingTransform makes a strong assumption that ResourceMaker::Make
 // is only called in acquire, not in the constructor.
+//
+// Idle instances are parked in per-thread slots so a thread usually gets back
+// the instance it released last, keeping its working set warm in cache.
+// Slots are claimed with atomic exchanges and instances are created lazily,
+// so the uncontended acquire/release pair takes no locks. At most
+// maxResources instances are handed out at once (Globals->parallelism by
+// default), callers beyond that block until one is released. An instance
+// count is claimed before each instance is made, so no more than
+// maxResources instances ever exist, which licensed SDK contexts rely on.
 template <typename T>
 class Resource
 {
-    QSharedPointer< ResourceMaker<T> > resourceMaker;
-    QSharedPointer< QList<T*> > availableResources;
-    QSharedPointer<QMutex> lock;
-    QSharedPointer<QSemaphore> totalResources;
+    struct Pool
+    {
+        QSharedPointer< ResourceMaker<T> > resourceMaker;
+
+        int slotCount;
+        QAtomicPointer<T> *slots;
+
+        // Idle instances that didn't fit in a slot
+        QMutex overflowLock;
+        QList<T*> overflow;
+        QAtomicInt overflowSize;
+
+        int maxResources;
+        QAtomicInt inUse;
+        QAtomicInt waiters;
+        QMutex waitLock;
+        QWaitCondition available;
+
+        QAtomicInt instances;
+
+        Pool(ResourceMaker<T> *rm, int max)
+            : resourceMaker(rm)
+            , slotCount(2 * std::max(1, max))
+            , slots(new QAtomicPointer<T>[slotCount])
+            , maxResources(max)
+        {}
+
+        ~Pool()
+        {
+            for (int i=0; i<slotCount; i++)
+                destroy(slots[i].load());
+            foreach (T *resource, overflow)
+                destroy(resource);
+            delete[] slots;
+        }
+
+        // Claims room for a new instance, fails once maxResources exist
+        bool claim()
+        {
+            forever {
+                const int current = instances.load();
+                if (current >= maxResources)
+                    return false;
+                if (instances.testAndSetOrdered(current, current + 1))
+                    return true;
+            }
+        }
+
+        // Requires a successful claim()
+        T *create()
+        {
+            Metrics::gauge("br_resource_instances")->add(1);
+            return resourceMaker->make();
+        }
+
+        T *takeIdle()
+        {
+            // Prefer the instance this thread released last, then any idle one
+            const int home = resourceThreadIndex() % slotCount;
+            for (int i=0; i<slotCount; i++) {
+                QAtomicPointer<T> &slot = slots[(home + i) % slotCount];
+                if (slot.load()) {
+                    T *resource = slot.fetchAndStoreAcquire(NULL);
+                    if (resource)
+                        return resource;
+                }
+            }
+
+            if (overflowSize.load() > 0) {
+                QMutexLocker locker(&overflowLock);
+                if (!overflow.isEmpty()) {
+                    overflowSize.deref();
+                    return overflow.takeLast();
+                }
+            }
+            return NULL;
+        }
+
+        void destroy(T *resource)
+        {
+            if (!resource) return;
+            instances.deref();
+            Metrics::gauge("br_resource_instances")->add(-1);
+            delete resource;
+        }
+
+        void reserve()
+        {
+            forever {
+                const int current = inUse.load();
+                if (current < maxResources) {
+                    if (inUse.testAndSetAcquire(current, current + 1))
+                        return;
+                    continue;
+                }
+
+                // Slow path, wait for a release
+                QMutexLocker locker(&waitLock);
+                waiters.ref();
+                while (inUse.load() >= maxResources)
+                    available.wait(&waitLock);
+                waiters.deref();
+            }
+        }
+
+        void unreserve()
+        {
+            inUse.fetchAndAddOrdered(-1);
+            if (waiters.load() > 0) {
+                QMutexLocker locker(&waitLock);
+                available.wakeOne();
+            }
+        }
+    };
+
+    QSharedPointer<Pool> pool;
 
 public:
     Resource(ResourceMaker<T> *rm = new DefaultResourceMaker<T>())
-        : resourceMaker(rm)
-        , availableResources(new QList<T*>())
-        , lock(new QMutex())
-        , totalResources(new QSemaphore(br::Globals->parallelism))
+        : pool(new Pool(rm, br::Globals->parallelism))
     {}
 
-    ~Resource()
-    {
-        qDeleteAll(*availableResources);
-    }
-
     T *acquire() const
     {
-        totalResources->acquire();
-        lock->lock();
-
-        if (availableResources->isEmpty())
-            availableResources->append(resourceMaker->make());
-        T* resource = availableResources->takeFirst();
-
-        lock->unlock();
-
-        return resource;
+        pool->reserve();
+
+        // With maxResources instances made and fewer reserved, one is idle or
+        // about to be parked by a release that hasn't unreserved yet
+        forever {
+            if (T *resource = pool->takeIdle())
+                return resource;
+            if (pool->claim())
+                return pool->create();
+            QThread::yieldCurrentThread();
+        }
     }
 
     void release(T *resource) const
     {
-        lock->lock();
-        availableResources->append(resource);
-        lock->unlock();
-        totalResources->release();
+        const int home = resourceThreadIndex() % pool->slotCount;
+        bool parked = false;
+        for (int i=0; (i<pool->slotCount) && !parked; i++)
+            parked = pool->slots[(home + i) % pool->slotCount].testAndSetRelease(NULL, resource);
+
+        if (!parked) {
+            QMutexLocker locker(&pool->overflowLock);
+            pool->overflow.append(resource);
+            pool->overflowSize.ref();
+        }
+
+        pool->unreserve();
     }
 
+    // Idle instances made by the previous maker are discarded
     void setResourceMaker(ResourceMaker<T> *maker)
     {
-        resourceMaker = QSharedPointer< ResourceMaker<T> >(maker);
+        pool->resourceMaker = QSharedPointer< ResourceMaker<T> >(maker);
+        for (int i=0; i<pool->slotCount; i++)
+            pool->destroy(pool->slots[i].fetchAndStoreAcquire(NULL));
+        QMutexLocker locker(&pool->overflowLock);
+        foreach (T *resource, pool->overflow)
+            pool->destroy(resource);
+        pool->overflow.clear();
+        pool->overflowSize.store(0);
     }
 
     void setMaxResources(int max)
     {
-        totalResources = QSharedPointer<QSemaphore>(new QSemaphore(max));
+        QMutexLocker locker(&pool->waitLock);
+        pool->maxResources = max;
+        pool->available.wakeAll();
+    }
+
+    // Number of live instances, idle or in use
+    int instances() const
+    {
+        return pool->instances.load();
     }
 };
 
@@ -99,6 +99,14 @@ void br_enroll_n(int num_inputs, const char *inputs[], const char *gallery)
     else                Enroll(File(inputs[0]), gallery);
 }
 
+void br_enroll_multiple(const char *input, int num_galleries, const char *galleries[])
+{
+    QList<File> files;
+    for (int i=0; i<num_galleries; i++)
+        files.append(File(galleries[i]));
+    Enroll(File(input), files);
+}
+
 void br_project(const char *input, const char *gallery)
 {
     Project(File(input), File(gallery));
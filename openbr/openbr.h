@@ -144,6 +144,15 @@ BR_EXPORT void br_enroll(const char *input, const char *gallery = "");
  */
 BR_EXPORT void br_enroll_n(int num_inputs, const char *inputs[], const char *gallery = "");
 
+/*!
+ * \brief Enrolls an input with several algorithms in a single pass, sharing their common leading stages.
+ * \param input The br::Input set of images to enroll.
+ * \param num_galleries Number of galleries.
+ * \param galleries The br::Gallery files to contain the enrolled templates, each naming its algorithm like <tt>age.gal[algorithm=AgeEstimation]</tt>.
+ * \see br_enroll
+ */
+BR_EXPORT void br_enroll_multiple(const char *input, int num_galleries, const char *galleries[]);
+
 /*!
  * \brief A naive alternative to \ref br_enroll.
  */
@@ -479,5 +479,7 @@ $ br -help
  * \section mask Mask Matrix
  * A mask matrix (or \em mask) is a binary matrix specified on page 14 of <a href="MBGC_file_overview.pdf#page=14">MBGC File Overview</a> identifying the ground truth genuines and impostors of a corresponding \ref simmat.
  * Masks are identified with a <tt>.mask</tt> extension.
+ * Appending <tt>[implicit]</tt> to the mask file name passed to \ref br_make_mask stores per-row and per-column label and partition ids instead of the full matrix.
+ * Such masks are read transparently wherever a mask matrix is expected.
  * \see br_make_mask br_combine_masks
  */
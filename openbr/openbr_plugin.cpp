@@ -36,6 +36,7 @@
 #include "version.h"
 #include "core/bee.h"
 #include "core/common.h"
+#include "core/metrics.h"
 #include "core/opencvutils.h"
 #include "core/qtutils.h"
 #include "openbr/plugins/openbr_internal.h"
@@ -81,8 +82,14 @@ QString File::hash() const
 
 void File::append(const QVariantMap &metadata)
 {
-    foreach (const QString &key, metadata.keys())
-        set(key, metadata[key]);
+    // Share rather than copy when there is nothing to merge into
+    if (m_metadata.isEmpty()) {
+        m_metadata = metadata;
+        return;
+    }
+
+    for (QVariantMap::const_iterator i = metadata.constBegin(); i != metadata.constEnd(); ++i)
+        set(i.key(), i.value());
 }
 
 void File::append(const File &other)
@@ -980,6 +987,8 @@ void br::Context::setProperty(const QString &key, const QString &value)
         QtUtils::touchDir(logFile);
         logFile.open(QFile::Append);
         logFile.write("================================================================================\n");
+    } else if (key == "metrics") {
+        Metrics::setOutput(metrics);
     }
 }
 
@@ -1268,7 +1277,7 @@ FileList Gallery::files()
 {
     FileList files;
     bool done = false;
-    while (!done) files.append(readBlock(&done).files());
+    while (!done) files.append(readFileBlock(&done));
     return files;
 }
 
@@ -1476,9 +1485,11 @@ void Distance::compare(const TemplateList &target, const TemplateList &query, Ou
 
 QList<float> Distance::compare(const TemplateList &targets, const Template &query) const
 {
+    static Metric *comparisons = Metrics::counter("br_comparisons_total");
     QList<float> scores; scores.reserve(targets.size());
     foreach (const Template &target, targets)
         scores.append(compare(target, query));
+    comparisons->add(targets.size());
     return scores;
 }
 
@@ -1518,10 +1529,12 @@ float Distance::compare(const uchar *, const uchar *, size_t) const
 /* Distance - private methods */
 void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
 {
+    static Metric *comparisons = Metrics::counter("br_comparisons_total");
     for (int i=0; i<query.size(); i++)
         for (int j=0; j<target.size(); j++)
             if (target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(),i+queryOffset, j+targetOffset);
             else output->setRelative(compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+    comparisons->add(double(query.size()) * target.size());
 }
 
 void br::applyAdditionalProperties(const File &temp, Transform *target)
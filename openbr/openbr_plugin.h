@@ -649,6 +649,12 @@ public:
     Q_PROPERTY(QString log READ get_log WRITE set_log RESET reset_log)
     BR_PROPERTY(QString, log, "")
 
+    /*!
+     * \brief Optional file to periodically write Prometheus-style runtime metrics to.
+     */
+    Q_PROPERTY(QString metrics READ get_metrics WRITE set_metrics RESET reset_metrics)
+    BR_PROPERTY(QString, metrics, "")
+
     /*!
      * \brief Path to use when resolving images specified with relative paths.
      * Multiple paths can be specified using a semicolon separator.
@@ -741,6 +747,36 @@ public:
     Q_PROPERTY(int crossValidate READ get_crossValidate WRITE set_crossValidate RESET reset_crossValidate)
     BR_PROPERTY(int, crossValidate, 0)
 
+    /*!
+     * \brief Stream training data through the algorithm in blocks, holding at most this many templates for each trainable transform (0 trains on everything at once).
+     */
+    Q_PROPERTY(int trainingSamples READ get_trainingSamples WRITE set_trainingSamples RESET reset_trainingSamples)
+    BR_PROPERTY(int, trainingSamples, 0)
+
+    /*!
+     * \brief When streaming training data, sample at most this many templates per label (0 samples uniformly).
+     */
+    Q_PROPERTY(int trainingInstances READ get_trainingInstances WRITE set_trainingInstances RESET reset_trainingInstances)
+    BR_PROPERTY(int, trainingInstances, 0)
+
+    /*!
+     * \brief When streaming training data, the number of passes made for transforms that train incrementally.
+     */
+    Q_PROPERTY(int trainingEpochs READ get_trainingEpochs WRITE set_trainingEpochs RESET reset_trainingEpochs)
+    BR_PROPERTY(int, trainingEpochs, 1)
+
+    /*!
+     * \brief Shard GalleryCompare galleries across NUMA nodes, copying each shard once into memory local to the node whose CPUs compare it.
+     */
+    Q_PROPERTY(bool numa READ get_numa WRITE set_numa RESET reset_numa)
+    BR_PROPERTY(bool, numa, false)
+
+    /*!
+     * \brief Pin the threads of stream processing to NUMA nodes, keeping each frame on one node as it moves through the stages.
+     */
+    Q_PROPERTY(bool pinStages READ get_pinStages WRITE set_pinStages RESET reset_pinStages)
+    BR_PROPERTY(bool, pinStages, false)
+
     QHash<QString,QString> abbreviations; /*!< \brief Used by br::Transform::make() to expand abbreviated algorithms into their complete definitions. */
     QTime startTime; /*!< \brief Used to estimate timeRemaining(). */
 
@@ -1106,6 +1142,7 @@ public:
     TemplateList read(); /*!< \brief Retrieve all the stored templates. */
     FileList files(); /*!< \brief Retrieve all the stored template files. */
     virtual TemplateList readBlock(bool *done) = 0; /*!< \brief Retrieve a portion of the stored templates. */
+    virtual FileList readFileBlock(bool *done) { return readBlock(done).files(); } /*!< \brief Retrieve a portion of the stored template files, galleries may skip matrix data. */
     void writeBlock(const TemplateList &templates); /*!< \brief Serialize a template list. */
     virtual void write(const Template &t) = 0; /*!< \brief Serialize a template. */
     static Gallery *make(const File &file); /*!< \brief Make a gallery to/from a file on disk. */
@@ -1181,6 +1218,14 @@ public:
      */
     virtual void train(const QList<TemplateList> &data);
 
+    /*!< \brief Can the transform be trained from successive blocks of data with trainBlock() instead of all at once?
+     * Used when training data is streamed from the gallery, see Context::trainingSamples.
+     */
+    virtual bool incrementalTraining() const { return false; }
+
+    /*!< \brief Update the model with one block of training data, \em first is set for the first block of the first epoch. */
+    virtual void trainBlock(const TemplateList &block, bool first) { (void) block; (void) first; }
+
     /*!< \brief Apply the transform to a single template. Typically used by independent transforms */
     virtual void project(const Template &src, Template &dst) const = 0;
 
@@ -1426,6 +1471,16 @@ BR_EXPORT void Enroll(const File &input, const File &gallery = File());
  */
 BR_EXPORT void Enroll(TemplateList &tmpl);
 
+/*!
+ * \brief High-level function for enrolling one input with several algorithms in a single pass.
+ *
+ * Each gallery names its algorithm with an \c algorithm argument.
+ * Leading stages that the algorithms share, by definition and trained state, are only run once.
+ * Galleries with \c append skip templates they already contain; \c multiProcess is not supported.
+ * \see br_enroll_multiple
+ */
+BR_EXPORT void Enroll(const File &input, const QList<File> &galleries);
+
 /*!
  * \brief A naive alternative to \ref br::Enroll
  */
@@ -16,6 +16,7 @@
 
 #include <opencv2/objdetect/objdetect.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/metrics.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/resource.h"
 #include "openbr/core/qtutils.h"
@@ -158,12 +159,145 @@ static void trainCascade(const TrainParams &params)
 namespace br
 {
         
+// A parsed cascade whose stage, tree, node and leaf tables are shared read-only by every CascadeInstance
+class SharedCascadeClassifier : public CascadeClassifier
+{
+public:
+    // Old-format cascades keep per-image state inside the parsed cascade itself
+    bool shareable() const
+    {
+        return oldCascade.empty() && !featureEvaluator.empty();
+    }
+
+    const Data &stageData() const
+    {
+        return data;
+    }
+
+    size_t sharedBytes() const
+    {
+        return data.stages.size()      * sizeof(Data::Stage)
+             + data.classifiers.size() * sizeof(Data::DTree)
+             + data.nodes.size()       * sizeof(Data::DTreeNode)
+             + data.leaves.size()      * sizeof(float)
+             + data.subsets.size()     * sizeof(int);
+    }
+
+    // Only reads the cascade, per-image state lives in the caller's evaluator
+    int classify(Ptr<FeatureEvaluator> &evaluator, Point pt, double &weight)
+    {
+        return runAt(evaluator, pt, weight);
+    }
+};
+
+// Per-thread detection state over a SharedCascadeClassifier.
+// Only the stage list detectMultiScale() checks and the feature evaluator setImage() writes into are per instance,
+// FeatureEvaluator::clone() would share the feature vector, so it is read from the cascade's features node.
+class CascadeInstance : public CascadeClassifier
+{
+    QSharedPointer<SharedCascadeClassifier> model;
+
+    // Scans strips of window positions against the shared cascade, as OpenCV's CascadeClassifierInvoker does
+    class Strips : public ParallelLoopBody
+    {
+        SharedCascadeClassifier *model;
+        Ptr<FeatureEvaluator> evaluator;
+        Size processingRectSize, winSize;
+        int stripSize, yStep, stageCount;
+        double factor;
+        vector<Rect> &rectangles;
+        vector<int> *rejectLevels;
+        vector<double> *levelWeights;
+        mutable QMutex lock;
+
+    public:
+        Strips(SharedCascadeClassifier *model, const Ptr<FeatureEvaluator> &evaluator, Size processingRectSize, int stripSize, int yStep, double factor,
+               vector<Rect> &rectangles, vector<int> *rejectLevels, vector<double> *levelWeights)
+            : model(model), evaluator(evaluator), processingRectSize(processingRectSize), stripSize(stripSize), yStep(yStep), factor(factor),
+              rectangles(rectangles), rejectLevels(rejectLevels), levelWeights(levelWeights)
+        {
+            const Size origWinSize = model->stageData().origWinSize;
+            winSize = Size(cvRound(origWinSize.width * factor), cvRound(origWinSize.height * factor));
+            stageCount = int(model->stageData().stages.size());
+        }
+
+        void operator()(const Range &range) const
+        {
+            Ptr<FeatureEvaluator> window = evaluator->clone();
+            const int y2 = std::min(range.end * stripSize, processingRectSize.height);
+            for (int y = range.start * stripSize; y < y2; y += yStep) {
+                for (int x = 0; x < processingRectSize.width; x += yStep) {
+                    double weight;
+                    int result = model->classify(window, Point(x, y), weight);
+                    if (rejectLevels) {
+                        if (result == 1)
+                            result = -stageCount;
+                        if (stageCount + result < 4) {
+                            QMutexLocker locker(&lock);
+                            rectangles.push_back(Rect(cvRound(x*factor), cvRound(y*factor), winSize.width, winSize.height));
+                            rejectLevels->push_back(-result);
+                            levelWeights->push_back(weight);
+                        }
+                    } else if (result > 0) {
+                        QMutexLocker locker(&lock);
+                        rectangles.push_back(Rect(cvRound(x*factor), cvRound(y*factor), winSize.width, winSize.height));
+                    }
+                    if (result == 0)
+                        x += yStep;
+                }
+            }
+        }
+    };
+
+public:
+    CascadeInstance(const QSharedPointer<SharedCascadeClassifier> &model, const FileNode &features)
+        : model(model)
+    {
+        const Data &shared = model->stageData();
+        data.isStumpBased = shared.isStumpBased;
+        data.stageType = shared.stageType;
+        data.featureType = shared.featureType;
+        data.ncategories = shared.ncategories;
+        data.origWinSize = shared.origWinSize;
+        data.stages = shared.stages; // A few bytes per stage, detectMultiScale() checks them
+
+        featureEvaluator = FeatureEvaluator::create(data.featureType);
+        if (!featureEvaluator->read(features))
+            qFatal("Failed to read cascade features.");
+    }
+
+protected:
+    bool detectSingleScale(const Mat &image, int stripCount, Size processingRectSize, int stripSize, int yStep, double factor,
+                           vector<Rect> &candidates, vector<int> &rejectLevels, vector<double> &levelWeights, bool outputRejectLevels)
+    {
+        if (!featureEvaluator->setImage(image, data.origWinSize))
+            return false;
+
+        vector<Rect> rectangles;
+        vector<int> levels;
+        vector<double> weights;
+        const Strips strips(model.data(), featureEvaluator, processingRectSize, stripSize, yStep, factor,
+                            rectangles, outputRejectLevels ? &levels : NULL, outputRejectLevels ? &weights : NULL);
+        parallel_for_(Range(0, stripCount), strips);
+        candidates.insert(candidates.end(), rectangles.begin(), rectangles.end());
+        rejectLevels.insert(rejectLevels.end(), levels.begin(), levels.end());
+        levelWeights.insert(levelWeights.end(), weights.begin(), weights.end());
+        return true;
+    }
+};
+
 class CascadeResourceMaker : public ResourceMaker<CascadeClassifier>
 {
     QString file;
+    mutable QMutex prototypeLock;
+    mutable QSharedPointer<SharedCascadeClassifier> prototype;
+    mutable FileStorage storage; // Kept open for the prototype's features node
+    mutable bool unshareable;
+    mutable size_t sharedBytes;
 
 public:
     CascadeResourceMaker(const QString &model)
+        : unshareable(false), sharedBytes(0)
     {
         file = Globals->sdkPath + "/share/openbr/models/";
         if      (model == "Ear")         file += "haarcascades/haarcascade_ear.xml";
@@ -178,14 +312,44 @@ public:
         }                             
     }
 
+    ~CascadeResourceMaker()
+    {
+        Metrics::gauge("br_cascade_shared_bytes")->add(-double(sharedBytes));
+    }
+
 private:
-    CascadeClassifier *make() const
+    SharedCascadeClassifier *load() const
     {
-        CascadeClassifier *cascade = new CascadeClassifier();
+        SharedCascadeClassifier *cascade = new SharedCascadeClassifier();
         if (!cascade->load(file.toStdString()))
             qFatal("Failed to load: %s", qPrintable(file));
         return cascade;
     }
+
+    CascadeClassifier *make() const
+    {
+        // Parse the model once, later instances evaluate its trees in place
+        QMutexLocker locker(&prototypeLock);
+        if (prototype.isNull() && !unshareable) {
+            SharedCascadeClassifier *cascade = load();
+            if (!cascade->shareable()) {
+                unshareable = true;
+                return cascade;
+            }
+            prototype = QSharedPointer<SharedCascadeClassifier>(cascade);
+            if (!storage.open(file.toStdString(), FileStorage::READ))
+                qFatal("Failed to load: %s", qPrintable(file));
+            sharedBytes = prototype->sharedBytes();
+            Metrics::gauge("br_cascade_shared_bytes")->add(double(sharedBytes));
+        }
+        if (unshareable) {
+            locker.unlock();
+            return load();
+        }
+
+        // Reading the features node is cheap next to parsing the stages
+        return new CascadeInstance(prototype, storage.getFirstTopLevelNode()["features"]);
+    }
 };
 
 /*!
@@ -101,29 +101,61 @@ class KNNTransform : public Transform
     BR_PROPERTY(QString, galleryName, "")
 
     TemplateList gallery;
+    QStringList galleryLabels;
+
+    void indexGallery()
+    {
+        galleryLabels.clear();
+        foreach (const Template &t, gallery)
+            galleryLabels.append(t.file.get<QString>(inputVariable));
+    }
 
     void train(const TemplateList &data)
     {
         distance->train(data);
         gallery = data;
+        indexGallery();
     }
 
     void project(const Template &src, Template &dst) const
     {
-        QList< QPair<float, int> > sortedScores = Common::Sort(distance->compare(gallery, src), true);
+        vote(distance->compare(gallery, src), dst);
+    }
+
+    // Scores the whole block against the gallery at once, letting the distance parallelize over it
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (src.isEmpty() || gallery.isEmpty()) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        QScopedPointer<MatrixOutput> scores(MatrixOutput::make(gallery.files(), src.files()));
+        distance->compare(gallery, src, scores.data());
+        for (int i=0; i<src.size(); i++) {
+            dst.append(Template());
+            vote(OpenCVUtils::matrixToVector<float>(scores->data.row(i)), dst.last());
+        }
+    }
+
+    void vote(const QList<float> &scores, Template &dst) const
+    {
+        // Only the k nearest neighbors are needed unless subjects are removed from consideration
+        const int n = ((k < 1) || (numSubjects > 1)) ? std::numeric_limits<int>::max() : k;
+        QList< QPair<float, int> > sortedScores = Common::Sort(scores, true, n);
 
         QStringList subjects;
         for (int i=0; i<numSubjects; i++) {
             QHash<QString, float> votes;
             const int max = (k < 1) ? sortedScores.size() : std::min(k, sortedScores.size());
             for (int j=0; j<max; j++)
-                votes[gallery[sortedScores[j].second].file.get<QString>(inputVariable)] += (weighted ? sortedScores[j].first : 1);
+                votes[galleryLabels[sortedScores[j].second]] += (weighted ? sortedScores[j].first : 1);
             subjects.append(votes.keys()[votes.values().indexOf(Common::Max(votes.values()))]);
 
             // Remove subject from consideration
             if (subjects.size() < numSubjects)
                 for (int j=sortedScores.size()-1; j>=0; j--)
-                    if (gallery[sortedScores[j].second].file.get<QString>(inputVariable) == subjects.last())
+                    if (galleryLabels[sortedScores[j].second] == subjects.last())
                         sortedScores.removeAt(j);
         }
 
@@ -139,12 +171,14 @@ class KNNTransform : public Transform
     void load(QDataStream &stream)
     {
         stream >> gallery;
+        indexGallery();
     }
 
     void init()
     {
         if (!galleryName.isEmpty())
             gallery = TemplateList::fromGallery(galleryName);
+        indexGallery();
     }
 };
 
@@ -16,12 +16,16 @@
 
 #include <QFutureSynchronizer>
 #include <QtConcurrentRun>
+#include <algorithm>
+#include <functional>
 #include <numeric>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/imgproc/imgproc_c.h>
 #include "openbr_internal.h"
 
 #include "openbr/core/distance_sse.h"
+#include "openbr/core/metrics.h"
+#include "openbr/core/numa.h"
 #include "openbr/core/qtutils.h"
 #include "openbr/core/opencvutils.h"
 
@@ -161,12 +165,27 @@ class PipeDistance : public Distance
     Q_PROPERTY(QList<br::Distance*> distances READ get_distances WRITE set_distances RESET reset_distances)
     BR_PROPERTY(QList<br::Distance*>, distances, QList<br::Distance*>())
 
+    typedef QHash<QString, MetadataFilterDistance::Index> Indexes;
+
+    // One entry per distance, empty for distances that aren't metadata filters
+    struct TargetIndex
+    {
+        TemplateList targets; // Keeps the list's shared data, which identifies it, alive
+        QList<Indexes> indexes;
+    };
+
+    mutable QMutex indexLock;
+    mutable QList< QSharedPointer<const TargetIndex> > indexCache; // Most recently used first
+
     void train(const TemplateList &data)
     {
         QFutureSynchronizer<void> futures;
         foreach (br::Distance *distance, distances)
             futures.addFuture(QtConcurrent::run(distance, &Distance::train, data));
         futures.waitForFinished();
+
+        QMutexLocker locker(&indexLock);
+        indexCache.clear();
     }
 
     float compare(const Template &a, const Template &b) const
@@ -179,6 +198,125 @@ class PipeDistance : public Distance
         }
         return result;
     }
+
+    // Only the candidates that pass every metadata filter are scored
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        static Metric *comparisons = Metrics::counter("br_comparisons_total");
+        QVector<int> candidates;
+        const bool all = select(index(targets), query, candidates);
+
+        QList<float> scores;
+        if (all) {
+            scores.reserve(targets.size());
+            foreach (const Template &target, targets)
+                scores.append(compareCandidate(target, query));
+        } else {
+            const QVector<float> rejected(targets.size(), -std::numeric_limits<float>::max());
+            scores = rejected.toList();
+            foreach (int candidate, candidates)
+                scores[candidate] = compareCandidate(targets[candidate], query);
+        }
+        comparisons->add(all ? targets.size() : candidates.size());
+        return scores;
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        static Metric *comparisons = Metrics::counter("br_comparisons_total");
+        const QSharedPointer<const TargetIndex> indexes = index(target);
+        double compared = 0;
+        for (int i=0; i<query.size(); i++) {
+            QVector<int> candidates;
+            const bool all = select(indexes, query[i], candidates);
+            int next = 0;
+            for (int j=0; j<target.size(); j++) {
+                const bool candidate = all || ((next < candidates.size()) && (candidates[next] == j));
+                if (candidate && !all) next++;
+                if (!candidate || target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(), i+queryOffset, j+targetOffset);
+                else output->setRelative(compareCandidate(target[j], query[i]), i+queryOffset, j+targetOffset);
+            }
+            compared += all ? target.size() : candidates.size();
+        }
+        comparisons->add(compared);
+    }
+
+    // Indexes are cached per target list, so a gallery searched one probe at a time is only indexed once.
+    // Lists are identified by their implicitly shared data, copies of a list share its entry.
+    QSharedPointer<const TargetIndex> index(const TemplateList &targets) const
+    {
+        static const int maxCached = 16, minCachedSize = 1024; // Small lists are cheaper to index than to evict a gallery for
+
+        bool filtered = false;
+        foreach (const br::Distance *distance, distances)
+            filtered = filtered || dynamic_cast<const MetadataFilterDistance*>(distance);
+        if (!filtered)
+            return QSharedPointer<const TargetIndex>();
+
+        {
+            QMutexLocker locker(&indexLock);
+            for (int i=0; i<indexCache.size(); i++)
+                if ((indexCache[i]->targets.size() == targets.size()) && (indexCache[i]->targets.constBegin() == targets.constBegin())) {
+                    if (!covers(*indexCache[i])) {
+                        indexCache.removeAt(i);
+                        break;
+                    }
+                    indexCache.move(i, 0);
+                    return indexCache.first();
+                }
+        }
+
+        QSharedPointer<TargetIndex> built(new TargetIndex());
+        built->targets = targets;
+        foreach (const br::Distance *distance, distances) {
+            const MetadataFilterDistance *filter = dynamic_cast<const MetadataFilterDistance*>(distance);
+            built->indexes.append(filter ? filter->index(targets) : Indexes());
+        }
+
+        if (targets.size() >= minCachedSize) {
+            QMutexLocker locker(&indexLock);
+            indexCache.prepend(built);
+            while (indexCache.size() > maxCached)
+                indexCache.removeLast();
+        }
+        return built;
+    }
+
+    bool covers(const TargetIndex &indexes) const
+    {
+        for (int i=0; i<distances.size(); i++)
+            if (const MetadataFilterDistance *filter = dynamic_cast<const MetadataFilterDistance*>(distances[i]))
+                if (!filter->covers(indexes.indexes[i]))
+                    return false;
+        return true;
+    }
+
+    // Returns true when every target is a candidate, otherwise fills the ascending candidate indices
+    bool select(const QSharedPointer<const TargetIndex> &indexes, const Template &query, QVector<int> &candidates) const
+    {
+        bool all = true;
+        if (indexes)
+            for (int i=0; i<distances.size(); i++)
+                if (const MetadataFilterDistance *filter = dynamic_cast<const MetadataFilterDistance*>(distances[i]))
+                    filter->select(indexes->indexes[i], query, candidates, all);
+        return all;
+    }
+
+    // Equivalent to compare() for targets that already passed select()
+    float compareCandidate(const Template &a, const Template &b) const
+    {
+        float result = -std::numeric_limits<float>::max();
+        foreach (const br::Distance *distance, distances) {
+            if (dynamic_cast<const MetadataFilterDistance*>(distance)) {
+                result = 0;
+                continue;
+            }
+            result = distance->compare(a, b);
+            if (result == -std::numeric_limits<float>::max())
+                return result;
+        }
+        return result;
+    }
 };
 
 BR_REGISTER(Distance, PipeDistance)
@@ -452,21 +590,217 @@ class SumDistance : public Distance
 
 BR_REGISTER(Distance, SumDistance)
 
+/*!
+ * \ingroup distances
+ * \brief Compares templates holding sets of matrices, such as video frames or media collections, by aggregating their pairwise scores.
+ * \note Without a distance the matrices are flattened and scored by inner product, all pairs in one matrix product, so they should be L2 normalized.
+ *       Otherwise each pair is scored with distance.
+ * \note Aggregation: Mean, Max, TopKMean (mean of the k best pairs) and Softmax (pairs weighted by exp(score/temperature)).
+ * \note When threshold and maxScore are both set, Mean and TopKMean stop once the pairs left to score cannot lift the aggregate to threshold.
+ *       The upper bound reached so far, which is below threshold, is returned instead of the exact score.
+ */
+class SetDistance : public Distance
+{
+    Q_OBJECT
+    Q_ENUMS(Aggregation)
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(Aggregation aggregation READ get_aggregation WRITE set_aggregation RESET reset_aggregation STORED false)
+    Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k STORED false)
+    Q_PROPERTY(float temperature READ get_temperature WRITE set_temperature RESET reset_temperature STORED false)
+    Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
+    Q_PROPERTY(float maxScore READ get_maxScore WRITE set_maxScore RESET reset_maxScore STORED false)
+
+public:
+    /*!< */
+    enum Aggregation {Mean, Max, TopKMean, Softmax};
+
+private:
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(Aggregation, aggregation, Mean)
+    BR_PROPERTY(int, k, 3)
+    BR_PROPERTY(float, temperature, 0.1f)
+    BR_PROPERTY(float, threshold, -std::numeric_limits<float>::max())
+    BR_PROPERTY(float, maxScore, std::numeric_limits<float>::max())
+
+    void train(const TemplateList &src)
+    {
+        if (distance)
+            distance->train(src);
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return -std::numeric_limits<float>::max();
+        return compareSets(a, stack(a), b, stack(b));
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        static Metric *comparisons = Metrics::counter("br_comparisons_total");
+        const Mat queryRows = stack(query);
+        QList<float> scores; scores.reserve(targets.size());
+        foreach (const Template &target, targets)
+            scores.append((target.isEmpty() || query.isEmpty()) ? -std::numeric_limits<float>::max()
+                                                                : compareSets(target, stack(target), query, queryRows));
+        comparisons->add(targets.size());
+        return scores;
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        static Metric *comparisons = Metrics::counter("br_comparisons_total");
+
+        // Flatten every template of the block once rather than once per comparison
+        QVector<Mat> targetRows(target.size()), queryRows(query.size());
+        for (int j=0; j<target.size(); j++) targetRows[j] = stack(target[j]);
+        for (int i=0; i<query.size(); i++)  queryRows[i] = stack(query[i]);
+
+        for (int i=0; i<query.size(); i++)
+            for (int j=0; j<target.size(); j++)
+                if (target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(), i+queryOffset, j+targetOffset);
+                else output->setRelative(compareSets(target[j], targetRows[j], query[i], queryRows[i]), i+queryOffset, j+targetOffset);
+        comparisons->add(double(query.size()) * target.size());
+    }
+
+    // One row per matrix for the inner product, empty when a distance scores the pairs
+    Mat stack(const Template &t) const
+    {
+        if (distance || t.isEmpty())
+            return Mat();
+
+        const int dims = t.first().total() * t.first().channels();
+        Mat rows(t.size(), dims, CV_32FC1);
+        for (int i=0; i<t.size(); i++) {
+            const Mat &m = t[i];
+            if ((m.depth() != CV_32F) || ((int)(m.total() * m.channels()) != dims))
+                qFatal("SetDistance expects CV_32F matrices of equal size.");
+            (m.isContinuous() ? m : m.clone()).reshape(1, 1).copyTo(rows.row(i));
+        }
+        return rows;
+    }
+
+    float compareSets(const Template &a, const Mat &aRows, const Template &b, const Mat &bRows) const
+    {
+        const bool bounded = (threshold != -std::numeric_limits<float>::max()) &&
+                             (maxScore != std::numeric_limits<float>::max()) &&
+                             ((aggregation == Mean) || (aggregation == TopKMean));
+
+        // Score all pairs at once, or a row at a time when the bound may end the comparison early
+        const int step = bounded ? 1 : a.size();
+        QVector<float> scores;
+        scores.reserve(a.size() * b.size());
+        for (int i=0; i<a.size(); i+=step) {
+            const int end = std::min(i+step, a.size());
+            if (distance) {
+                for (int ia=i; ia<end; ia++)
+                    foreach (const Mat &mb, b) {
+                        const float score = distance->compare(a[ia], mb);
+                        if (score != -std::numeric_limits<float>::max())
+                            scores.append(score);
+                    }
+            } else {
+                const Mat pairs = aRows.rowRange(i, end) * bRows.t();
+                for (int r=0; r<pairs.rows; r++)
+                    for (int c=0; c<pairs.cols; c++)
+                        scores.append(pairs.at<float>(r, c));
+            }
+
+            const int remaining = (a.size() - end) * b.size();
+            if (bounded && (remaining > 0)) {
+                const float bound = aggregate(scores, remaining);
+                if (bound < threshold)
+                    return bound;
+            }
+        }
+
+        if (scores.isEmpty())
+            return -std::numeric_limits<float>::max();
+        return aggregate(scores, 0);
+    }
+
+    // Aggregate of scores plus remaining unscored pairs assumed to reach maxScore
+    float aggregate(const QVector<float> &scores, int remaining) const
+    {
+        switch (aggregation) {
+          case Mean:
+            return (std::accumulate(scores.begin(), scores.end(), 0.0) + double(remaining) * maxScore) / (scores.size() + remaining);
+          case Max:
+            return *std::max_element(scores.begin(), scores.end());
+          case TopKMean: {
+            const int best = std::min(std::max(k, 1), scores.size() + remaining);
+            const int padded = std::min(remaining, best);
+            std::vector<float> top(scores.begin(), scores.end());
+            std::partial_sort(top.begin(), top.begin() + (best - padded), top.end(), std::greater<float>());
+            return (std::accumulate(top.begin(), top.begin() + (best - padded), 0.0) + double(padded) * maxScore) / best;
+          }
+          case Softmax: {
+            // Shifted by the best score so the exponentials can't overflow
+            const float best = *std::max_element(scores.begin(), scores.end());
+            double weighted = 0, total = 0;
+            foreach (float score, scores) {
+                const double weight = exp((score - best) / temperature);
+                weighted += weight * score;
+                total += weight;
+            }
+            return weighted / total;
+          }
+          default:
+            qFatal("Invalid aggregation.");
+        }
+        return 0;
+    }
+};
+
+BR_REGISTER(Distance, SetDistance)
+
 /*!
  * \ingroup transforms
  * \brief Compare each template to a fixed gallery (with name = galleryName), using the specified distance.
  * dst will contain a 1 by n vector of scores.
  * \author Charles Otto \cite caotto
+ * \note With aggregation, gallery templates are grouped by subjectKey into compact subject representatives,
+ *       either the Mean of each subject's templates or up to the given number of Medoids.
+ *       Probes are compared to the representatives first, and only the templates of the best expand subjects are compared individually.
+ *       The other templates are scored by their subject's best representative.
+ *       Failures to enroll are left out of the representatives, subjects whose templates differ in shape are always compared individually.
+ *       Mean requires CV_32F templates, byte or int8 distances would misread a float mean, so quantized galleries should use Medoids.
  */
 class GalleryCompareTransform : public Transform
 {
     Q_OBJECT
+    Q_ENUMS(Aggregation)
     Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED true)
     Q_PROPERTY(QString galleryName READ get_galleryName WRITE set_galleryName RESET reset_galleryName STORED false)
+    Q_PROPERTY(Aggregation aggregation READ get_aggregation WRITE set_aggregation RESET reset_aggregation STORED false)
+    Q_PROPERTY(QString subjectKey READ get_subjectKey WRITE set_subjectKey RESET reset_subjectKey STORED false)
+    Q_PROPERTY(int medoids READ get_medoids WRITE set_medoids RESET reset_medoids STORED false)
+    Q_PROPERTY(int expand READ get_expand WRITE set_expand RESET reset_expand STORED false)
+
+public:
+    /*!< */
+    enum Aggregation {None, Mean, Medoids};
+
+private:
     BR_PROPERTY(br::Distance*, distance, NULL)
     BR_PROPERTY(QString, galleryName, "")
+    BR_PROPERTY(Aggregation, aggregation, None)
+    BR_PROPERTY(QString, subjectKey, "Label")
+    BR_PROPERTY(int, medoids, 3)
+    BR_PROPERTY(int, expand, 10)
 
     TemplateList gallery;
+    TemplateList representatives;
+    QList<int> representativeSubjects; // Subject index of each representative
+    QList<QList<int> > subjects;       // Gallery indices of each subject's templates
+    QList<int> gallerySubjects;        // Subject index of each gallery template
+    QList<int> unrepresented;          // Subjects without representatives, always expanded
+    NumaGallery placedGallery, placedRepresentatives; // Copies local to each NUMA node, see Context::numa
+
+    QList<float> compareAll(const TemplateList &targets, const NumaGallery &placed, const Template &src) const
+    {
+        return placed.isEmpty() ? distance->compare(targets, src) : placed.compare(distance, src);
+    }
 
     void project(const Template &src, Template &dst) const
     {
@@ -474,19 +808,64 @@ class GalleryCompareTransform : public Transform
         if (gallery.isEmpty())
             return;
 
-        QList<float> line = distance->compare(gallery, src);
+        if (aggregation == None) {
+            QList<float> line = compareAll(gallery, placedGallery, src);
+            dst.m() = OpenCVUtils::toMat(line, 1);
+            return;
+        }
+
+        // Score the compact subject representatives
+        const QList<float> representativeScores = compareAll(representatives, placedRepresentatives, src);
+        QVector<float> subjectScores(subjects.size(), -std::numeric_limits<float>::max());
+        for (int i=0; i<representatives.size(); i++)
+            subjectScores[representativeSubjects[i]] = std::max(subjectScores[representativeSubjects[i]], representativeScores[i]);
+
+        QList<float> line; line.reserve(gallery.size());
+        for (int i=0; i<gallery.size(); i++)
+            line.append(subjectScores[gallerySubjects[i]]);
+
+        // Expand the best subjects to their individual templates
+        QList< QPair<float,int> > ranked;
+        for (int i=0; i<subjects.size(); i++)
+            ranked.append(QPair<float,int>(subjectScores[i], i));
+        const int expanded = std::min(expand, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + expanded, ranked.end(), std::greater< QPair<float,int> >());
+
+        QList<int> expandedSubjects;
+        for (int i=0; i<expanded; i++)
+            expandedSubjects.append(ranked[i].second);
+        foreach (int subject, unrepresented)
+            if (!expandedSubjects.contains(subject))
+                expandedSubjects.append(subject);
+
+        TemplateList candidates;
+        QList<int> candidateIndices;
+        foreach (int subject, expandedSubjects)
+            foreach (int index, subjects[subject]) {
+                candidates.append(gallery[index]);
+                candidateIndices.append(index);
+            }
+        const QList<float> candidateScores = distance->compare(candidates, src);
+        for (int i=0; i<candidateIndices.size(); i++)
+            line[candidateIndices[i]] = candidateScores[i];
+
         dst.m() = OpenCVUtils::toMat(line, 1);
     }
 
     void init()
     {
-        if (!galleryName.isEmpty())
+        if (!galleryName.isEmpty()) {
             gallery = TemplateList::fromGallery(galleryName);
+            buildSubjects();
+        }
+        place();
     }
 
     void train(const TemplateList &data)
     {
         gallery = data;
+        buildSubjects();
+        place();
     }
 
     void store(QDataStream &stream) const
@@ -499,6 +878,147 @@ class GalleryCompareTransform : public Transform
     {
         br::Object::load(stream);
         stream >> gallery;
+        buildSubjects();
+        place();
+    }
+
+    // Only the searches that scan a whole list are sharded, expanded candidates are scattered across the gallery.
+    // The placed copies replace the list they were made from, so each template is only held once.
+    void place()
+    {
+        placedGallery.clear();
+        placedRepresentatives.clear();
+        if (!Globals->numa)
+            return;
+
+        if (aggregation == None) {
+            placedGallery.place(gallery);
+            if (!placedGallery.isEmpty())
+                gallery = placedGallery.templates();
+        } else {
+            placedRepresentatives.place(representatives);
+            if (!placedRepresentatives.isEmpty())
+                representatives = placedRepresentatives.templates();
+        }
+    }
+
+    void buildSubjects()
+    {
+        representatives.clear();
+        representativeSubjects.clear();
+        subjects.clear();
+        gallerySubjects.clear();
+        unrepresented.clear();
+        if (aggregation == None)
+            return;
+
+        QHash<QString,int> subjectIndices;
+        for (int i=0; i<gallery.size(); i++) {
+            const QString subject = gallery[i].file.get<QString>(subjectKey);
+            if (!subjectIndices.contains(subject)) {
+                subjectIndices.insert(subject, subjects.size());
+                subjects.append(QList<int>());
+            }
+            subjects[subjectIndices[subject]].append(i);
+            gallerySubjects.append(subjectIndices[subject]);
+        }
+
+        for (int i=0; i<subjects.size(); i++) {
+            const QList<int> members = aggregable(subjects[i]);
+            if (members.isEmpty()) {
+                unrepresented.append(i);
+            } else if (aggregation == Mean) {
+                representatives.append(meanTemplate(members));
+                representativeSubjects.append(i);
+            } else {
+                foreach (int index, selectMedoids(members)) {
+                    representatives.append(gallery[index]);
+                    representativeSubjects.append(i);
+                }
+            }
+        }
+    }
+
+    // Members that can be aggregated, skipping failures to enroll.
+    // Empty if there are none, or if their matrices differ in count, size or type.
+    QList<int> aggregable(const QList<int> &members) const
+    {
+        QList<int> usable;
+        foreach (int index, members) {
+            const Template &t = gallery[index];
+            if (t.isEmpty() || t.first().empty())
+                continue;
+
+            if (!usable.isEmpty()) {
+                const Template &reference = gallery[usable.first()];
+                if (t.size() != reference.size())
+                    return QList<int>();
+                for (int m=0; m<t.size(); m++)
+                    if ((t[m].size() != reference[m].size()) || (t[m].type() != reference[m].type()))
+                        return QList<int>();
+            }
+            usable.append(index);
+        }
+        return usable;
+    }
+
+    // Members must come from aggregable()
+    Template meanTemplate(const QList<int> &members) const
+    {
+        Template mean(gallery[members.first()].file);
+        for (int m=0; m<gallery[members.first()].size(); m++) {
+            if (gallery[members.first()][m].depth() != CV_32F)
+                qFatal("GalleryCompare aggregation=Mean requires CV_32F templates, use aggregation=Medoids for quantized templates.");
+
+            Mat sum;
+            foreach (int index, members) {
+                Mat mat;
+                gallery[index][m].convertTo(mat, CV_32F);
+                if (sum.empty()) sum = mat;
+                else             sum += mat;
+            }
+            mean.append(sum / members.size());
+        }
+        return mean;
+    }
+
+    // Greedily picks the templates that best cover the subject, maximizing the summed similarity of each template to its nearest medoid.
+    // Members must come from aggregable().
+    QList<int> selectMedoids(const QList<int> &members) const
+    {
+        if (members.size() <= medoids)
+            return members;
+
+        const int n = members.size();
+        Mat similarity(n, n, CV_32FC1);
+        for (int i=0; i<n; i++)
+            for (int j=0; j<n; j++)
+                similarity.at<float>(i,j) = distance->compare(gallery[members[j]], gallery[members[i]]);
+
+        QList<int> selected;
+        QVector<float> coverage(n, -std::numeric_limits<float>::max());
+        while (selected.size() < medoids) {
+            int best = -1;
+            double bestGain = -std::numeric_limits<double>::max();
+            for (int c=0; c<n; c++) {
+                if (selected.contains(c)) continue;
+                double gain = 0;
+                for (int i=0; i<n; i++)
+                    gain += std::max(coverage[i], similarity.at<float>(i,c));
+                if (gain > bestGain) {
+                    bestGain = gain;
+                    best = c;
+                }
+            }
+            selected.append(best);
+            for (int i=0; i<n; i++)
+                coverage[i] = std::max(coverage[i], similarity.at<float>(i,best));
+        }
+
+        QList<int> indices;
+        foreach (int c, selected)
+            indices.append(members[c]);
+        return indices;
     }
 
 public:
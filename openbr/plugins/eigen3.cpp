@@ -527,6 +527,33 @@ class LDATransform : public Transform
             dst.m().at<float>(0,0) = dst.m().at<float>(0,0) / stdDev;
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        const int dimsIn = mean.rows();
+        foreach (const Template &t, src)
+            if ((int)t.m().total() != dimsIn || t.m().type() != CV_32FC1) {
+                Transform::project(src, dst);
+                return;
+            }
+
+        // Stack the inputs so the whole list is projected with a single matrix product
+        Eigen::MatrixXf in(dimsIn, src.size());
+        for (int i=0; i<src.size(); i++) {
+            const cv::Mat m = src[i].m().isContinuous() ? src[i].m() : src[i].m().clone();
+            in.col(i) = Eigen::Map<const Eigen::VectorXf>(m.ptr<float>(), dimsIn) - mean;
+        }
+        Eigen::MatrixXf out = projection.transpose() * in;
+        if (normalize && isBinary)
+            out.row(0) /= stdDev;
+
+        dst.reserve(src.size());
+        for (int i=0; i<src.size(); i++) {
+            Template t(src[i].file, cv::Mat(1, dimsOut, CV_32FC1));
+            Eigen::Map<Eigen::VectorXf>(t.m().ptr<float>(), dimsOut) = out.col(i);
+            dst.append(t);
+        }
+    }
+
     void store(QDataStream &stream) const
     {
         stream << pcaKeep;
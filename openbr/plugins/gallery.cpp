@@ -31,6 +31,7 @@
 #include "openbr/universal_template.h"
 #include "openbr/core/bee.h"
 #include "openbr/core/common.h"
+#include "openbr/core/metrics.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/qtutils.h"
 
@@ -174,6 +175,10 @@ class BinaryGallery : public Gallery
         if (gallery.atEnd())
             gallery.seek(0);
 
+        static Metric *bytesRead = Metrics::counter("br_gallery_read_bytes_total");
+        static Metric *templatesRead = Metrics::counter("br_gallery_read_templates_total");
+        const qint64 start = gallery.pos();
+
         TemplateList templates;
         while ((templates.size() < readBlockSize) && !gallery.atEnd()) {
             const Template t = readTemplate();
@@ -187,10 +192,34 @@ class BinaryGallery : public Gallery
                 break;
         }
 
+        bytesRead->add(gallery.pos() - start);
+        templatesRead->add(templates.size());
         *done = gallery.atEnd();
         return templates;
     }
 
+    FileList readFileBlock(bool *done)
+    {
+        readOpen();
+        if (gallery.atEnd())
+            gallery.seek(0);
+
+        FileList files;
+        while ((files.size() < readBlockSize) && !gallery.atEnd()) {
+            File f;
+            if (readMetadata(f)) {
+                files.append(f);
+                files.last().set("progress", position());
+            }
+
+            if (gallery.isSequential())
+                break;
+        }
+
+        *done = gallery.atEnd();
+        return files;
+    }
+
     void write(const Template &t)
     {
         writeOpen();
@@ -216,6 +245,14 @@ protected:
 
     virtual Template readTemplate() = 0;
     virtual void writeTemplate(const Template &t) = 0;
+
+    // Returns false for records readBlock() would discard, override to skip matrix payloads
+    virtual bool readMetadata(File &f)
+    {
+        const Template t = readTemplate();
+        f = t.file;
+        return !t.isEmpty() || !t.file.isNull();
+    }
 };
 
 /*!
@@ -237,6 +274,27 @@ class galGallery : public BinaryGallery
         return t;
     }
 
+    bool readMetadata(File &f)
+    {
+        // Mirrors the QList<cv::Mat> serialization, seeking over each payload
+        quint32 matrices;
+        stream >> matrices;
+        for (quint32 i=0; i<matrices; i++) {
+            int rows, cols, type, len;
+            stream >> rows >> cols >> type >> len;
+
+            // Pipes may skip less than requested while data arrives, loop like the Mat reader
+            while (len > 0) {
+                const int skipped = stream.skipRawData(len);
+                if ((skipped == -1) || ((skipped == 0) && stream.atEnd()))
+                    qFatal("Mat deserialization failure, expected %d more bytes.", len);
+                len -= skipped;
+            }
+        }
+        stream >> f;
+        return (matrices > 0) || !f.isNull();
+    }
+
     void writeTemplate(const Template &t)
     {
         if (t.isEmpty() && t.file.isNull())
@@ -310,6 +368,68 @@ class utGallery : public BinaryGallery
         return t;
     }
 
+    bool readMetadata(File &f)
+    {
+        br_universal_template ut;
+        if (gallery.read((char*)&ut, sizeof(br_universal_template)) != sizeof(br_universal_template)) {
+            if (!gallery.atEnd())
+                qFatal("Failed to read universal template header!");
+            return false;
+        }
+
+        // Only the URL and the optional eye header are needed, the feature vector is skipped
+        const bool hasEyes = (ut.algorithmID <= -1) && (ut.algorithmID >= -3);
+        const qint64 bytesNeeded = ut.urlSize + (hasEyes ? 4*sizeof(uint32_t) : 0);
+        QByteArray data(int(bytesNeeded), Qt::Uninitialized);
+        if (readFully(data.data(), bytesNeeded) != bytesNeeded)
+            qFatal("Unexepected EOF while reading universal template data, needed: %d bytes.", int(bytesNeeded));
+        const qint64 bytesSkipped = ut.urlSize + ut.fvSize - bytesNeeded;
+        if (gallery.isSequential() ? (skipFully(bytesSkipped) != bytesSkipped) : !gallery.seek(gallery.pos() + bytesSkipped))
+            qFatal("Unexepected EOF while skipping universal template data, needed: %d bytes.", int(bytesSkipped));
+
+        f.set("ImageID", QVariant(QByteArray((const char*)ut.imageID, 16).toHex()));
+        f.set("AlgorithmID", ut.algorithmID);
+        f.set("URL", QString(data.data()));
+        if (hasEyes) {
+            const uint32_t *eyes = reinterpret_cast<const uint32_t*>(data.data() + ut.urlSize);
+            f.set("FrontalFace", QRectF(ut.x, ut.y, ut.width, ut.height));
+            f.set("First_Eye", QPointF(eyes[0], eyes[1]));
+            f.set("Second_Eye", QPointF(eyes[2], eyes[3]));
+        } else {
+            f.set("X", ut.x);
+            f.set("Y", ut.y);
+            f.set("Width", ut.width);
+            f.set("Height", ut.height);
+        }
+        f.set("Label", ut.label);
+        return true;
+    }
+
+    qint64 readFully(char *dst, qint64 bytesNeeded)
+    {
+        qint64 total = 0;
+        while (total < bytesNeeded) {
+            const qint64 bytesRead = gallery.read(dst + total, bytesNeeded - total);
+            if (bytesRead <= 0)
+                break;
+            total += bytesRead;
+        }
+        return total;
+    }
+
+    qint64 skipFully(qint64 bytesNeeded)
+    {
+        char buffer[4096];
+        qint64 total = 0;
+        while (total < bytesNeeded) {
+            const qint64 bytesRead = readFully(buffer, qMin(bytesNeeded - total, qint64(sizeof(buffer))));
+            if (bytesRead <= 0)
+                break;
+            total += bytesRead;
+        }
+        return total;
+    }
+
     void writeTemplate(const Template &t)
     {
         const QByteArray imageID = QByteArray::fromHex(t.file.get<QByteArray>("ImageID", QByteArray(32, '0')));
@@ -818,28 +938,13 @@ FileList FileList::fromGallery(const File &file, bool cache)
         return MemoryGalleries::galleries[targetMeta].files();
     }
 
+    // Galleries containing matrices skip them on disk where they can, see Gallery::readFileBlock
+    QScopedPointer<Gallery> gallery(Gallery::make(file));
     TemplateList templates;
-    // OK we read the data in some form, does the gallery type containing matrices?
-    if ((QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
-        // Retrieve it block by block, dropping matrices from read templates.
-        QScopedPointer<Gallery> gallery(Gallery::make(file));
-        gallery->set_readBlockSize(10);
-        bool done = false;
-        while (!done)
-        {
-            TemplateList tList = gallery->readBlock(&done);
-            for (int i=0; i < tList.size();i++)
-            {
-                tList[i].clear();
-                templates.append(tList[i].file);
-            }
-        }
-    }
-    else {
-        // this is a gallery format that doesn't include matrices, so we can just read it
-        QScopedPointer<Gallery> gallery(Gallery::make(file));
-        templates= gallery->read();
-    }
+    bool done = false;
+    while (!done)
+        foreach (const File &f, gallery->readFileBlock(&done))
+            templates.append(f);
 
     if (cache)
     {
@@ -1478,6 +1583,474 @@ class dbGallery : public Gallery
 
 BR_REGISTER(Gallery, dbGallery)
 
+// Runs calls on a dedicated thread, blocking the caller until they finish
+class SQLiteOwner : public QObject
+{
+    Q_OBJECT
+    QThread *basis;
+
+public:
+    struct Call
+    {
+        virtual ~Call() {}
+        virtual void run() = 0;
+    };
+
+    SQLiteOwner()
+    {
+        basis = new QThread;
+        moveToThread(basis);
+        connect(this, SIGNAL(pulseCall(void*)), this, SLOT(callInternal(void*)), Qt::BlockingQueuedConnection);
+        basis->start();
+    }
+
+    ~SQLiteOwner()
+    {
+        basis->quit();
+        basis->wait();
+        delete basis;
+    }
+
+    void run(Call &call)
+    {
+        if (QThread::currentThread() == basis) call.run();
+        else                                   emit pulseCall(&call);
+    }
+
+signals:
+    void pulseCall(void *call);
+
+private slots:
+    void callInternal(void *call)
+    {
+        static_cast<Call*>(call)->run();
+    }
+};
+
+/*!
+ * \ingroup galleries
+ * \brief SQLite gallery with indexed metadata columns.
+ *
+ * Each template is one row. Its metadata and its matrices are stored as separate BLOBs, so listing files never reads feature vectors.
+ * Every key in \em columns is also copied into its own indexed column.
+ * \em filter entries of the form \c key=value on those columns are evaluated by SQLite. Filters on other keys are checked after decoding.
+ * Reads stream through a forward-only cursor \em readBlockSize rows at a time, writes are committed in transactions of \em batchSize templates.
+ * Like \c .gal, writing replaces the existing rows unless \c append is set.
+ * Rows inserted by other tools only need a \c name and any of \em columns to be enrolled from.
+ * Columns missing from an existing table are added and filled in from the stored metadata.
+ * The connection lives on a thread owned by the gallery, so the gallery may be read and written from any thread.
+ */
+class sqliteGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(QString table READ get_table WRITE set_table RESET reset_table STORED false)
+    Q_PROPERTY(QStringList columns READ get_columns WRITE set_columns RESET reset_columns STORED false)
+    Q_PROPERTY(QStringList filter READ get_filter WRITE set_filter RESET reset_filter STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    BR_PROPERTY(QString, table, "templates")
+    BR_PROPERTY(QStringList, columns, QStringList() << "Label")
+    BR_PROPERTY(QStringList, filter, QStringList())
+    BR_PROPERTY(int, batchSize, 1000)
+
+#ifndef BR_EMBEDDED
+    // Entry points are run on the owner's thread, a QSqlDatabase connection may only be used from the thread that opened it
+    struct Call : public SQLiteOwner::Call
+    {
+        enum Kind { Read, ReadFiles, Write, Size, Close };
+
+        sqliteGallery *gallery;
+        Kind kind;
+        const Template *input;
+        TemplateList output;
+        bool done;
+        qint64 size;
+
+        Call(sqliteGallery *gallery, Kind kind, const Template *input = NULL)
+            : gallery(gallery), kind(kind), input(input), done(false), size(0) {}
+
+        void run()
+        {
+            switch (kind) {
+              case Read:      output = gallery->readRows(true, &done); break;
+              case ReadFiles: output = gallery->readRows(false, &done); break;
+              case Write:     gallery->writeRow(*input); break;
+              case Size:      size = gallery->countRows(); break;
+              case Close:     gallery->close(); break;
+            }
+        }
+    };
+
+    QScopedPointer<SQLiteOwner> owner;
+    QString connection;
+    QSqlDatabase db;
+    QScopedPointer<QSqlQuery> cursor, insert;
+    bool cursorMatrices;
+    QList< QPair<QString,QString> > residualFilters; // Filters on keys without a column
+    qint64 rowsRead, pendingWrites;
+
+public:
+    sqliteGallery() : cursorMatrices(false), rowsRead(0), pendingWrites(0) {}
+
+    ~sqliteGallery()
+    {
+        if (owner.isNull()) return;
+        Call call(this, Call::Close);
+        owner->run(call);
+    }
+
+private:
+    void close()
+    {
+        if (connection.isEmpty()) return;
+        commit();
+        cursor.reset();
+        insert.reset();
+        db.close();
+        db = QSqlDatabase();
+        QSqlDatabase::removeDatabase(connection);
+        connection.clear();
+    }
+
+    void init()
+    {
+        // Identifiers can't be bound, so only allow plain names
+        static const QRegExp identifier("[A-Za-z_][A-Za-z0-9_]*");
+        if (!identifier.exactMatch(table))
+            qFatal("Invalid table name %s.", qPrintable(table));
+        foreach (const QString &column, columns)
+            if (!identifier.exactMatch(column) || (column == "id") || (column == "name") || (column == "file") || (column == "data"))
+                qFatal("Invalid column name %s.", qPrintable(column));
+
+        if (owner.isNull())
+            owner.reset(new SQLiteOwner());
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        Call call(this, Call::Read);
+        owner->run(call);
+        *done = call.done;
+        return call.output;
+    }
+
+    FileList readFileBlock(bool *done)
+    {
+        Call call(this, Call::ReadFiles);
+        owner->run(call);
+        *done = call.done;
+        return call.output.files();
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        Call call(this, Call::Write, &t);
+        owner->run(call);
+    }
+
+    qint64 totalSize()
+    {
+        Call call(this, Call::Size);
+        owner->run(call);
+        return call.size;
+    }
+
+    qint64 position()
+    {
+        return rowsRead;
+    }
+
+    void writeRow(const Template &t)
+    {
+        writeOpen();
+        if ((pendingWrites == 0) && !db.transaction())
+            qFatal("%s.", qPrintable(db.lastError().text()));
+
+        QByteArray metadata, data;
+        QDataStream metadataStream(&metadata, QIODevice::WriteOnly);
+        metadataStream << t.file;
+        if (!t.file.fte) { // Only write metadata for failure to enroll
+            QDataStream dataStream(&data, QIODevice::WriteOnly);
+            dataStream << static_cast< const QList<cv::Mat>& >(t);
+        }
+
+        insert->bindValue(0, t.file.name);
+        for (int i=0; i<columns.size(); i++) {
+            const QVariant value = t.file.value(columns[i]);
+            insert->bindValue(1+i, value.isValid() ? QVariant(value.toString()) : QVariant(QVariant::String));
+        }
+        insert->bindValue(1+columns.size(), metadata);
+        insert->bindValue(2+columns.size(), data);
+        if (!insert->exec())
+            qFatal("%s.", qPrintable(insert->lastError().text()));
+
+        if (++pendingWrites >= batchSize)
+            commit();
+    }
+
+    qint64 countRows()
+    {
+        readOpen();
+        QVariantList bindings;
+        QSqlQuery q(db);
+        if (!q.prepare("SELECT COUNT(*) FROM " + table + where(bindings)))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+        foreach (const QVariant &binding, bindings)
+            q.addBindValue(binding);
+        if (!q.exec() || !q.next())
+            qFatal("%s.", qPrintable(q.lastError().text()));
+        return q.value(0).toLongLong();
+    }
+
+    TemplateList readRows(bool matrices, bool *done)
+    {
+        static Metric *templatesRead = Metrics::counter("br_gallery_read_templates_total");
+
+        if (cursor.isNull() || (cursorMatrices != matrices))
+            startCursor(matrices);
+
+        TemplateList templates;
+        while ((templates.size() < readBlockSize) && !cursor.isNull()) {
+            if (!cursor->next()) {
+                cursor.reset(); // The next read starts over, like the other galleries
+                break;
+            }
+            rowsRead++;
+
+            Template t(readFile());
+            if (!accept(t.file))
+                continue;
+
+            const QByteArray data = matrices ? cursor->value(2).toByteArray() : QByteArray();
+            if (!data.isEmpty()) {
+                QDataStream stream(data);
+                QList<cv::Mat> m;
+                stream >> m;
+                t.append(m);
+            }
+
+            templates.append(t);
+            templates.last().file.set("progress", position());
+        }
+
+        templatesRead->add(templates.size());
+        *done = cursor.isNull();
+        return templates;
+    }
+
+    File readFile() const
+    {
+        const QByteArray metadata = cursor->value(1).toByteArray();
+        if (!metadata.isEmpty()) {
+            File f;
+            QDataStream stream(metadata);
+            stream >> f;
+            return f;
+        }
+
+        // Rows inserted outside of OpenBR only carry a name and columns
+        File f(cursor->value(0).toString());
+        for (int i=0; i<columns.size(); i++)
+            if (!cursor->value(3+i).isNull())
+                f.set(columns[i], cursor->value(3+i));
+        return f;
+    }
+
+    bool accept(const File &f) const
+    {
+        typedef QPair<QString,QString> Filter;
+        foreach (const Filter &residual, residualFilters)
+            if (f.value(residual.first).toString() != residual.second)
+                return false;
+        return true;
+    }
+
+    // Filters on indexed columns become the WHERE clause, the rest are left to accept()
+    QString where(QVariantList &bindings)
+    {
+        QStringList conditions;
+        residualFilters.clear();
+        foreach (const QString &entry, filter) {
+            const int equals = entry.indexOf('=');
+            if (equals == -1)
+                qFatal("Expected key=value filter, got %s.", qPrintable(entry));
+            const QString key = entry.left(equals);
+            const QString value = entry.mid(equals+1);
+            if (columns.contains(key)) {
+                conditions.append(key + " = ?");
+                bindings.append(value);
+            } else {
+                residualFilters.append(QPair<QString,QString>(key, value));
+            }
+        }
+        return conditions.isEmpty() ? QString() : " WHERE " + conditions.join(" AND ");
+    }
+
+    void startCursor(bool matrices)
+    {
+        readOpen();
+        commit();
+
+        QStringList fields;
+        fields << "name" << "file" << (matrices ? "data" : "NULL");
+        fields.append(columns);
+
+        QVariantList bindings;
+        const QString condition = where(bindings);
+        cursor.reset(new QSqlQuery(db));
+        cursor->setForwardOnly(true);
+        if (!cursor->prepare("SELECT " + fields.join(", ") + " FROM " + table + condition))
+            qFatal("%s.", qPrintable(cursor->lastError().text()));
+        foreach (const QVariant &binding, bindings)
+            cursor->addBindValue(binding);
+        if (!cursor->exec())
+            qFatal("%s.", qPrintable(cursor->lastError().text()));
+
+        cursorMatrices = matrices;
+        rowsRead = 0;
+    }
+
+    void open()
+    {
+        if (!connection.isEmpty())
+            return;
+
+        // Each instance needs its own connection, readers and writers may coexist
+        static QAtomicInt connections;
+        connection = "br_sqlite_" + QString::number(connections.fetchAndAddOrdered(1));
+        db = QSqlDatabase::addDatabase("QSQLITE", connection);
+        db.setDatabaseName(file.name);
+        if (!db.open())
+            qFatal("Failed to open SQLite database %s.", qPrintable(file.name));
+
+        QStringList definitions;
+        definitions << "id INTEGER PRIMARY KEY" << "name TEXT";
+        foreach (const QString &column, columns)
+            definitions.append(column + " TEXT");
+        definitions << "file BLOB" << "data BLOB";
+        exec("CREATE TABLE IF NOT EXISTS " + table + " (" + definitions.join(", ") + ")");
+        addMissingColumns();
+        foreach (const QString &column, columns)
+            exec("CREATE INDEX IF NOT EXISTS " + table + "_" + column + " ON " + table + " (" + column + ")");
+    }
+
+    // Tables created with fewer columns gain the new ones, filled in from each row's metadata
+    void addMissingColumns()
+    {
+        QSqlQuery info(db);
+        if (!info.exec("PRAGMA table_info(" + table + ")"))
+            qFatal("%s.", qPrintable(info.lastError().text()));
+        QStringList existing;
+        while (info.next())
+            existing.append(info.value(1).toString());
+
+        QStringList missing;
+        foreach (const QString &column, columns)
+            if (!existing.contains(column, Qt::CaseInsensitive))
+                missing.append(column);
+        if (missing.isEmpty())
+            return;
+
+        if (!existing.contains("file", Qt::CaseInsensitive))
+            qFatal("Table %s has no file column, can't add columns %s.", qPrintable(table), qPrintable(missing.join(", ")));
+
+        if (!db.transaction())
+            qFatal("%s.", qPrintable(db.lastError().text()));
+        QStringList assignments;
+        foreach (const QString &column, missing) {
+            exec("ALTER TABLE " + table + " ADD COLUMN " + column + " TEXT");
+            assignments.append(column + " = ?");
+        }
+
+        QSqlQuery rows(db), update(db);
+        rows.setForwardOnly(true);
+        if (!rows.exec("SELECT id, file FROM " + table + " WHERE file IS NOT NULL"))
+            qFatal("%s.", qPrintable(rows.lastError().text()));
+        if (!update.prepare("UPDATE " + table + " SET " + assignments.join(", ") + " WHERE id = ?"))
+            qFatal("%s.", qPrintable(update.lastError().text()));
+        while (rows.next()) {
+            File f;
+            QDataStream stream(rows.value(1).toByteArray());
+            stream >> f;
+            for (int i=0; i<missing.size(); i++) {
+                const QVariant value = f.value(missing[i]);
+                update.bindValue(i, value.isValid() ? QVariant(value.toString()) : QVariant(QVariant::String));
+            }
+            update.bindValue(missing.size(), rows.value(0));
+            if (!update.exec())
+                qFatal("%s.", qPrintable(update.lastError().text()));
+        }
+        if (!db.commit())
+            qFatal("%s.", qPrintable(db.lastError().text()));
+        qDebug("Added columns %s to %s.", qPrintable(missing.join(", ")), qPrintable(file.name));
+    }
+
+    void readOpen()
+    {
+        if (connection.isEmpty() && !QFileInfo(file.name).exists())
+            qFatal("File %s does not exist", qPrintable(file.name));
+        open();
+    }
+
+    void writeOpen()
+    {
+        if (!insert.isNull())
+            return;
+
+        QtUtils::touchDir(QFileInfo(file.name));
+        open();
+        cursor.reset();
+        if (!file.getBool("append"))
+            exec("DELETE FROM " + table);
+
+        QStringList fields, qMarks;
+        fields << "name";
+        fields.append(columns);
+        fields << "file" << "data";
+        for (int i=0; i<fields.size(); i++)
+            qMarks.append("?");
+
+        insert.reset(new QSqlQuery(db));
+        if (!insert->prepare("INSERT INTO " + table + " (" + fields.join(", ") + ") VALUES (" + qMarks.join(", ") + ")"))
+            qFatal("%s.", qPrintable(insert->lastError().text()));
+    }
+
+    void commit()
+    {
+        if (pendingWrites == 0)
+            return;
+
+        static Metric *templatesWritten = Metrics::counter("br_gallery_written_templates_total");
+        if (!db.commit())
+            qFatal("%s.", qPrintable(db.lastError().text()));
+        templatesWritten->add(pendingWrites);
+        pendingWrites = 0;
+    }
+
+    void exec(const QString &statement)
+    {
+        QSqlQuery q(db);
+        if (!q.exec(statement))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+    }
+#else // BR_EMBEDDED
+    TemplateList readBlock(bool *done)
+    {
+        *done = true;
+        return TemplateList();
+    }
+
+    void write(const Template &)
+    {
+        qFatal("Not supported.");
+    }
+#endif // BR_EMBEDDED
+};
+
+BR_REGISTER(Gallery, sqliteGallery)
+
 /*!
  * \ingroup inputs
  * \brief Input from a google image search.
@@ -1746,6 +2319,47 @@ BR_REGISTER(Gallery, vbbGallery)
 #endif
 
 
+/*!
+ * \brief Frames selected from a video source by gallery metadata.
+ *
+ * frames=[first,last] is an inclusive frame range, startTime and endTime narrow it by
+ * time in seconds, and step keeps every step'th frame. Disjoint ranges of one recording
+ * can be read by parallel workers without decoding from the start.
+ */
+struct FrameRange
+{
+    qint64 first, last; // last < 0 reads to the end of the source
+    int step;
+
+    FrameRange() : first(0), last(-1), step(1) {}
+
+    static FrameRange fromFile(const File &file, double fps)
+    {
+        FrameRange range;
+        const QList<int> frames = file.getList<int>("frames", QList<int>());
+        if (!frames.isEmpty()) {
+            range.first = qMax(frames.first(), 0);
+            if (frames.size() > 1) range.last = frames[1];
+        }
+
+        if (file.contains("startTime") || file.contains("endTime")) {
+            if (fps <= 0)
+                qFatal("Unknown frame rate for %s, use frames instead of startTime/endTime.", qPrintable(file.flat()));
+            if (file.contains("startTime"))
+                range.first = qMax(range.first, (qint64) ceil(file.get<float>("startTime") * fps));
+            if (file.contains("endTime")) {
+                const qint64 last = (qint64) floor(file.get<float>("endTime") * fps);
+                range.last = range.last < 0 ? last : qMin(range.last, last);
+            }
+        }
+
+        range.step = qMax(file.get<int>("step", 1), 1);
+        return range;
+    }
+
+    bool finished(qint64 frame) const { return last >= 0 && frame > last; }
+};
+
 // Read a video frame by frame using cv::VideoCapture
 class videoGallery : public Gallery
 {
@@ -1774,7 +2388,18 @@ public:
             QMutexLocker lock(&openLock);
 
             deferredInit();
+            range = FrameRange::fromFile(file, video.get(CV_CAP_PROP_FPS));
             idx = 0;
+            if (range.first > 0) {
+                // OpenCV has no keyframe table, the backend seeks to the nearest keyframe and decodes forward
+                video.set(CV_CAP_PROP_POS_FRAMES, range.first);
+                idx = range.first;
+            }
+        } else {
+            // grab() skips frames without converting them
+            for (int i=1; i<range.step; i++)
+                video.grab();
+            idx += range.step - 1;
         }
 
         Template output;
@@ -1782,7 +2407,7 @@ public:
         output.m() = cv::Mat();
 
         cv::Mat temp;
-        bool res = video.read(temp);
+        bool res = !range.finished(idx) && video.read(temp);
 
         if (!res) {
             // The video capture broke, return an empty list.
@@ -1798,10 +2423,11 @@ public:
         output.m() = temp.clone();
 
         output.file.set("progress", idx);
+        output.file.set("frame", idx);
         idx++;
 
         TemplateList rVal;
-        rVal.append(temp);
+        rVal.append(output);
         *done = false;
         return rVal;
     }
@@ -1813,6 +2439,7 @@ public:
 
 protected:
     cv::VideoCapture video;
+    FrameRange range;
 };
 BR_REGISTER(Gallery,videoGallery)
 
@@ -1869,7 +2496,7 @@ public:
 
         int headSize = 1024;
         // start at end of file to get full size
-        int fileSize = seqFile.tellg();
+        qint64 fileSize = seqFile.tellg();
         if (fileSize < headSize) {
             qDebug("No header in seq file");
             return false;
@@ -1924,42 +2551,13 @@ public:
         seqFile.seekg(4, std::ios::cur);
         // the size of a full raw file, with extra crap after img data
         trueImgSizeBytes = readInt();
+        double fps;
+        seqFile.read((char*)&fps, sizeof(double));
+        file.set("FrameRate", fps);
 
-        // gather all the frame positions in an array
-        seekPos.reserve(numFrames);
-        // start at end of header
-        seekPos.append(headSize);
-        // extra 8 bytes at end of img
-        int extra = 8;
-        for (int i=1; i<numFrames; i++) {
-            int s;
-            // compressed images have different sizes
-            // the first byte at the beginning of the file
-            // says how big the current img is
-            if (imgFormat == "compressed") {
-                int lastPos = seekPos[i-1];
-                seqFile.seekg(lastPos, std::ios::beg);
-                int currSize = readInt();
-                s = lastPos + currSize + extra;
-
-                // but there might be 16 extra bytes instead of 8...
-                if (i == 1) {
-                    seqFile.seekg(s, std::ios::beg);
-                    char zero;
-                    seqFile.read(&zero, 1);
-                    if (zero == 0) {
-                        s += 8;
-                        extra += 8;
-                    }
-                }
-            }
-            // raw images are all the same size
-            else {
-                s = headSize + (i*trueImgSizeBytes);
-            }
-
-            seekPos.enqueue(s);
-        }
+        loadIndex(headSize);
+        range = FrameRange::fromFile(file, fps);
+        frame = range.first;
 
 #ifdef CVMATIO
         if (basis.file.contains("vbb")) {
@@ -1988,17 +2586,15 @@ public:
         if (!isOpen()) {
             if (!open())
                 qFatal("Failed to open file %s for reading", qPrintable(file.name));
-            else
-                idx = 0;
         }
 
         // if we've reached the last frame, we're done
-        if (seekPos.size() == 0) {
+        if (frame >= seekPos.size() || range.finished(frame)) {
             *done = true;
             return TemplateList();
         }
 
-        seqFile.seekg(seekPos.dequeue(), std::ios::beg);
+        seqFile.seekg(seekPos[frame], std::ios::beg);
 
         cv::Mat temp;
         // let imdecode do all the work to decode the compressed img
@@ -2018,13 +2614,11 @@ public:
         }
         Template output;
         output.file = file;
-        if (!annotations.empty()) {
-            output.file.setRects(annotations.first().file.rects());
-            annotations.removeFirst();
-        }
+        if (frame < annotations.size())
+            output.file.setRects(annotations[frame].file.rects());
         output.m() = temp;
-        output.file.set("position",idx);
-        idx++;
+        output.file.set("position", frame);
+        frame += range.step;
 
         *done = false;
         TemplateList rVal;
@@ -2040,7 +2634,69 @@ public:
     }
 
 private:
-    qint64 idx;
+    qint64 frame;
+    FrameRange range;
+
+    // Frame offsets of compressed sequences are found by hopping from frame to frame,
+    // so they are computed once and cached next to the sequence as <file>.index
+    void loadIndex(int headSize)
+    {
+        const QFileInfo info(QtUtils::getAbsolutePath(file.name));
+        QFile cache(info.filePath() + ".index");
+        if ((imgFormat == "compressed") && cache.open(QFile::ReadOnly)) {
+            QDataStream stream(&cache);
+            qint64 size;
+            QDateTime modified;
+            stream >> size >> modified >> seekPos;
+            if ((stream.status() == QDataStream::Ok) && (size == info.size()) && (modified == info.lastModified()) && (seekPos.size() == numFrames))
+                return;
+        }
+        cache.close();
+
+        // gather all the frame positions in an array
+        seekPos.clear();
+        seekPos.reserve(numFrames);
+        // start at end of header
+        seekPos.append(headSize);
+        // extra 8 bytes at end of img
+        int extra = 8;
+        for (int i=1; i<numFrames; i++) {
+            qint64 s;
+            // compressed images have different sizes
+            // the first byte at the beginning of the file
+            // says how big the current img is
+            if (imgFormat == "compressed") {
+                qint64 lastPos = seekPos[i-1];
+                seqFile.seekg(lastPos, std::ios::beg);
+                int currSize = readInt();
+                s = lastPos + currSize + extra;
+
+                // but there might be 16 extra bytes instead of 8...
+                if (i == 1) {
+                    seqFile.seekg(s, std::ios::beg);
+                    char zero;
+                    seqFile.read(&zero, 1);
+                    if (zero == 0) {
+                        s += 8;
+                        extra += 8;
+                    }
+                }
+            }
+            // raw images are all the same size
+            else {
+                s = headSize + (qint64(i)*trueImgSizeBytes);
+            }
+
+            seekPos.append(s);
+        }
+
+        // A read-only location just means the index is rebuilt next time
+        if ((imgFormat == "compressed") && cache.open(QFile::WriteOnly)) {
+            QDataStream stream(&cache);
+            stream << info.size() << info.lastModified() << seekPos;
+        }
+    }
+
     int readInt()
     {
         int num;
@@ -2062,7 +2718,7 @@ private:
 
 protected:
     std::ifstream seqFile;
-    QQueue<int> seekPos;
+    QVector<qint64> seekPos; // byte offset of each frame
     int width, height, numChan, imgSizeBytes, trueImgSizeBytes, numFrames;
     QString imgFormat;
     TemplateList annotations;
@@ -14,11 +14,14 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QElapsedTimer>
 #include <QFutureSynchronizer>
 #include <QRegularExpression>
+#include <QThreadPool>
 #include <QtConcurrentRun>
 #include "openbr_internal.h"
 #include "openbr/core/common.h"
+#include "openbr/core/metrics.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/qtutils.h"
 #include "openbr/core/resource.h"
@@ -39,17 +42,20 @@ static TemplateList Expanded(const TemplateList &templates)
             continue;
         }
 
-        const QList<QPointF> points = t.file.points();
-        const QList<QRectF> rects = t.file.rects();
+        // Children share the parent's metadata and only detach it once to
+        // overwrite their slice of the landmarks, without converting them.
+        const QVariantList points = t.file.value("Points").toList();
+        const QVariantList rects = t.file.value("Rects").toList();
         if (points.size() % t.size() != 0) qFatal("Uneven point count.");
         if (rects.size() % t.size() != 0) qFatal("Uneven rect count.");
         const int pointStep = points.size() / t.size();
         const int rectStep = rects.size() / t.size();
 
+        expanded.reserve(expanded.size() + t.size());
         for (int i=0; i<t.size(); i++) {
             expanded.append(Template(t.file, t[i]));
-            expanded.last().file.setRects(rects.mid(i*rectStep, rectStep));
-            expanded.last().file.setPoints(points.mid(i*pointStep, pointStep));
+            expanded.last().file.set("Rects", rects.mid(i*rectStep, rectStep));
+            expanded.last().file.set("Points", points.mid(i*pointStep, pointStep));
         }
     }
     return expanded;
@@ -291,14 +297,14 @@ class ContractTransform : public UntrainableMetaTransform
         if (src.empty()) return;
         Template out;
 
+        // Gather the rects in one pass and assign them once at the end,
+        // appending to the metadata list per template is quadratic.
+        QList<QRectF> rects;
         foreach (const Template &t, src) {
             out.merge(t);
+            rects.append(t.file.rects());
         }
-        out.file.clearRects();
-        foreach (const Template &t, src) {
-            if (!t.file.rects().empty())
-                out.file.appendRects(t.file.rects());
-        }
+        out.file.setRects(rects);
         dst.clear();
         dst.append(out);
     }
@@ -319,11 +325,77 @@ BR_REGISTER(Transform, ContractTransform)
  *
  * The source br::Template is seperately given to each transform and the results are appended together.
  *
+ * When the global thread pool has idle threads, as when projecting a single template,
+ * the branches of each projection run concurrently instead of one after another.
+ * Branches measured to take less than \em minBranchCost milliseconds per call stay on the calling thread.
+ *
  * \see PipeTransform
  */
 class ForkTransform : public CompositeTransform
 {
     Q_OBJECT
+    Q_PROPERTY(bool parallelBranches READ get_parallelBranches WRITE set_parallelBranches RESET reset_parallelBranches STORED false)
+    Q_PROPERTY(float minBranchCost READ get_minBranchCost WRITE set_minBranchCost RESET reset_minBranchCost STORED false)
+    BR_PROPERTY(bool, parallelBranches, true)
+    BR_PROPERTY(float, minBranchCost, 2)
+
+    mutable QMutex costLock;
+    mutable QVector<double> branchCosts; // Running average milliseconds per template, negative until measured
+
+    void init()
+    {
+        CompositeTransform::init();
+        branchCosts = QVector<double>(transforms.size(), -1);
+    }
+
+    // Which branches are worth dispatching to the thread pool for n templates, empty to run them all in series
+    QList<bool> concurrentBranches(int n) const
+    {
+        QList<bool> concurrent;
+        QThreadPool *pool = QThreadPool::globalInstance();
+        if (!parallelBranches || (transforms.size() < 2) || (Globals->parallelism < 2) ||
+            (pool->activeThreadCount() >= pool->maxThreadCount()))
+            return concurrent;
+
+        QMutexLocker locker(&costLock);
+        int count = 0;
+        for (int i=0; i<transforms.size(); i++) {
+            const bool expensive = (branchCosts[i] < 0) || (branchCosts[i] * n >= minBranchCost);
+            concurrent.append(expensive);
+            if (expensive) count++;
+        }
+        if (count < 2)
+            concurrent.clear();
+        return concurrent;
+    }
+
+    void updateCost(int branch, qint64 elapsed, int n) const
+    {
+        if (n == 0) return;
+        QMutexLocker locker(&costLock);
+        const double cost = double(elapsed) / n;
+        branchCosts[branch] = (branchCosts[branch] < 0) ? cost : 0.9 * branchCosts[branch] + 0.1 * cost;
+    }
+
+    void projectBranch(int branch, const Template *src, Template *dst, bool *failed) const
+    {
+        QElapsedTimer timer; timer.start();
+        try {
+            *dst = (*transforms[branch])(*src);
+            *failed = false;
+        } catch (...) {
+            qWarning("Exception triggered when processing %s with transform %s", qPrintable(src->file.flat()), qPrintable(transforms[branch]->objectName()));
+            *failed = true;
+        }
+        updateCost(branch, timer.elapsed(), 1);
+    }
+
+    void projectBranchList(int branch, const TemplateList *src, TemplateList *dst) const
+    {
+        QElapsedTimer timer; timer.start();
+        transforms[branch]->project(*src, *dst);
+        updateCost(branch, timer.elapsed(), src->size());
+    }
 
     void train(const QList<TemplateList> &data)
     {
@@ -396,15 +468,29 @@ protected:
     // Apply each transform to src, concatenate the results
     void _project(const Template &src, Template &dst) const
     {
-        foreach (const Transform *f, transforms) {
-            try {
-                dst.merge((*f)(src));
-            } catch (...) {
-                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
+        QVector<Template> results(transforms.size());
+        QVector<bool> failed(transforms.size(), false);
+
+        const QList<bool> concurrent = concurrentBranches(1);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<transforms.size(); i++)
+            if (!concurrent.isEmpty() && concurrent[i])
+                futures.addFuture(QtConcurrent::run(this, &ForkTransform::projectBranch, i, &src, &results[i], &failed[i]));
+        for (int i=0; i<transforms.size(); i++)
+            if (concurrent.isEmpty() || !concurrent[i]) {
+                projectBranch(i, &src, &results[i], &failed[i]);
+                if (failed[i] && concurrent.isEmpty())
+                    break;
+            }
+        futures.waitForFinished();
+
+        for (int i=0; i<transforms.size(); i++) {
+            if (failed[i]) {
                 dst = Template(src.file);
                 dst.file.fte = true;
                 break;
             }
+            dst.merge(results[i]);
         }
     }
 
@@ -412,9 +498,19 @@ protected:
     {
         dst.reserve(src.size());
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
-        foreach (const Transform *f, transforms) {
-            TemplateList m;
-            f->project(src, m);
+
+        QVector<TemplateList> results(transforms.size());
+        const QList<bool> concurrent = concurrentBranches(src.size());
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<transforms.size(); i++)
+            if (!concurrent.isEmpty() && concurrent[i])
+                futures.addFuture(QtConcurrent::run(this, &ForkTransform::projectBranchList, i, &src, &results[i]));
+        for (int i=0; i<transforms.size(); i++)
+            if (concurrent.isEmpty() || !concurrent[i])
+                projectBranchList(i, &src, &results[i]);
+        futures.waitForFinished();
+
+        foreach (const TemplateList &m, results) {
             if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
             for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
         }
@@ -499,6 +595,9 @@ BR_REGISTER(Transform, CacheTransform)
  * \ingroup transforms
  * \brief Caches transform training.
  * \author Josh Klontz \cite jklontz
+ * \note Loaded models that are not time varying are immutable, so every LoadStore of the same model file,
+ *       including those made by Transform::clone(), shares a single instance.
+ *       Setting a property the shared model has first gives this LoadStore its own copy.
  */
 class LoadStoreTransform : public MetaTransform
 {
@@ -533,9 +632,51 @@ public:
     {
         if (br::Object::setPropertyRecursive(name, value))
             return true;
+
+        // Composites offer a property to each child in turn, only give up the shared model when it has it
+        if (shared) {
+            if (!hasPropertyRecursive(transform, name))
+                return false;
+            detach();
+        }
         return transform->setPropertyRecursive(name, value);
     }
 private:
+    // Whether setPropertyRecursive() would find the property below object, checked without modifying it
+    static bool hasPropertyRecursive(const QObject *object, const QString &name)
+    {
+        const QMetaObject *meta = object->metaObject();
+        if (meta->indexOfProperty(qPrintable(name)) != -1)
+            return true;
+
+        QList<Transform*> children;
+        if (const LoadStoreTransform *loadStore = qobject_cast<const LoadStoreTransform*>(object))
+            children.append(loadStore->transform);
+        for (int i=0; i<meta->propertyCount(); i++) {
+            const QVariant child = meta->property(i).read(object);
+            if      (child.userType() == qMetaTypeId<Transform*>())         children.append(child.value<Transform*>());
+            else if (child.userType() == qMetaTypeId< QList<Transform*> >()) children.append(child.value< QList<Transform*> >());
+        }
+
+        foreach (const Transform *child, children)
+            if (child && hasPropertyRecursive(child, name))
+                return true;
+        return false;
+    }
+
+    struct Model
+    {
+        QWeakPointer<Transform> transform;
+        QString transformString;
+        qint64 bytes;
+
+        Model() : bytes(0) {}
+    };
+
+    static QHash<QString, Model> models; // Keyed by file path and modification time
+    static QMutex modelsLock;
+
+    QSharedPointer<Transform> shared;
 
     void init()
     {
@@ -605,6 +746,43 @@ private:
         const QString file = getFileName();
         if (file.isEmpty()) return false;
 
+        const QFileInfo info(file);
+        const QString key = info.absoluteFilePath() + "@" + QString::number(info.lastModified().toMSecsSinceEpoch());
+        {
+            QMutexLocker locker(&modelsLock);
+            const Model model = models.value(key);
+            shared = model.transform.toStrongRef();
+            if (shared) {
+                static Metric *savedBytes = Metrics::counter("br_shared_model_bytes_total");
+                savedBytes->add(model.bytes);
+                qDebug("Sharing %s", qPrintable(file));
+                transformString = model.transformString;
+                transform = shared.data();
+                return true;
+            }
+        }
+
+        const qint64 bytes = load(file);
+        if (transform->timeVarying())
+            return true;
+
+        // Not owned by this LoadStore any more, the last one using it deletes it
+        transform->setParent(NULL);
+        shared = QSharedPointer<Transform>(transform);
+
+        QMutexLocker locker(&modelsLock);
+        Model &model = models[key];
+        if (model.transform.isNull()) {
+            model.transform = shared;
+            model.transformString = transformString;
+            model.bytes = bytes;
+        }
+        return true;
+    }
+
+    // Returns the size of the model's serialized state
+    qint64 load(const QString &file)
+    {
         qDebug("Loading %s", qPrintable(file));
         QByteArray data;
         QtUtils::readFile(file, data, true);
@@ -612,10 +790,20 @@ private:
         stream >> transformString;
         transform = Transform::make(transformString);
         transform->load(stream);
-        return true;
+        return data.size();
+    }
+
+    // Replaces the shared model with a private copy that can be modified
+    void detach()
+    {
+        shared.clear();
+        load(getFileName());
     }
 };
 
+QHash<QString, LoadStoreTransform::Model> LoadStoreTransform::models;
+QMutex LoadStoreTransform::modelsLock;
+
 BR_REGISTER(Transform, LoadStoreTransform)
 
 /*!
@@ -666,6 +854,98 @@ class FTETransform : public Transform
 
 BR_REGISTER(Transform, FTETransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Fails templates to enroll when a cheap quality measure is out of range, so the stages after it in a Pipe are skipped.
+ *
+ * The measure is read from the \em key metadata set by \em transform (its object name by default), or from its output
+ * when that is a single element matrix. Rectangle metadata is measured by its shorter side.
+ * Templates with neither are gated, as a missing measurement usually means the measured step found nothing.
+ * \em transform only measures the template, which passes through unchanged apart from the measurement (when not already present) and, when gated, an \c FTEReason.
+ *
+ * Cascade reports the whole image as its detection when nothing is found, so gate missing faces on its ROCMode \c Confidence rather than on the detection's size,
+ * the fallback's \c Confidence is 1:
+ * \code
+ * Open+Cascade(FrontalFace,ROCMode=true)+Gate(Identity,key=Confidence,min=2,reason=NoFace)+ASEFEyes+...
+ * \endcode
+ * \see FTETransform
+ */
+class GateTransform : public UntrainableMetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(QString key READ get_key WRITE set_key RESET reset_key STORED false)
+    Q_PROPERTY(float min READ get_min WRITE set_min RESET reset_min STORED false)
+    Q_PROPERTY(float max READ get_max WRITE set_max RESET reset_max STORED false)
+    Q_PROPERTY(QString reason READ get_reason WRITE set_reason RESET reset_reason STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(QString, key, "")
+    BR_PROPERTY(float, min, -std::numeric_limits<float>::max())
+    BR_PROPERTY(float, max,  std::numeric_limits<float>::max())
+    BR_PROPERTY(QString, reason, "")
+
+    Metric *rejected;
+
+    void init()
+    {
+        if (key.isEmpty() && transform) key = transform->objectName();
+        if (reason.isEmpty()) reason = key;
+        rejected = Metrics::counter("br_gate_rejections_total{reason=\"" + reason + "\"}");
+    }
+
+    // Returns false when there is nothing to measure
+    bool measure(const Template &measured, float &value) const
+    {
+        const QVariant metadata = measured.file.value(key);
+        if (metadata.canConvert<QRectF>() && (metadata.type() != QVariant::String)) {
+            const QRectF rect = metadata.toRectF();
+            value = std::min(rect.width(), rect.height());
+            return true;
+        }
+        if (metadata.isValid()) {
+            bool ok;
+            value = metadata.toFloat(&ok);
+            return ok;
+        }
+        if ((measured.size() == 1) && (measured.m().total() == 1) && (measured.m().channels() == 1)) {
+            Mat m;
+            measured.m().convertTo(m, CV_32F);
+            value = m.at<float>(0);
+            return true;
+        }
+        return false;
+    }
+
+    void gate(Template &dst) const
+    {
+        dst.file.fte = true;
+        dst.file.set("FTEReason", reason);
+        rejected->add();
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        if (src.file.fte)
+            return;
+
+        Template measured;
+        transform->project(src, measured);
+        float value;
+        if (measured.file.fte || !measure(measured, value)) {
+            gate(dst);
+            return;
+        }
+
+        if (!dst.file.contains(key))
+            dst.file.set(key, value);
+        if ((value < min) || (value > max))
+            gate(dst);
+    }
+};
+
+BR_REGISTER(Transform, GateTransform)
+
 
 static void _projectList(const Transform *transform, const TemplateList *src, TemplateList *dst)
 {
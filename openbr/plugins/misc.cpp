@@ -19,6 +19,7 @@
 #include <QRegularExpression>
 #include <opencv2/highgui/highgui.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/metrics.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/qtutils.h"
 
@@ -724,8 +725,10 @@ class GalleryOutputTransform : public TimeVaryingTransform
         if (src.empty())
             return;
         dst = src;
-        for (int i=0; i < dst.size();i++) {
-            if (dst[i].file.getBool("FTE"))
+
+        // Serialize straight from the frame unless a failure flag needs restoring
+        for (int i=0; i < src.size(); i++) {
+            if (!src[i].file.fte && src[i].file.getBool("FTE"))
                 dst[i].file.fte = true;
         }
         writer->writeBlock(dst);
@@ -818,6 +821,31 @@ public:
 
 BR_REGISTER(Transform, ProgressCounterTransform)
 
+/*!
+ * \ingroup initializers
+ * \brief Writes runtime metrics to br::Context::metrics once a second.
+ *
+ * The writer thread only runs while br::Context::metrics is set, see Context::setProperty, and the metrics are written one last time at shutdown.
+ */
+class MetricsInitializer : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const
+    {
+        Metrics::setOutput(Globals->metrics);
+    }
+
+    void finalize() const
+    {
+        Metrics::setOutput(QString());
+        if (!Globals->metrics.isEmpty())
+            Metrics::write(Globals->metrics);
+    }
+};
+
+BR_REGISTER(Initializer, MetricsInitializer)
+
 
 class OutputTransform : public TimeVaryingTransform
 {
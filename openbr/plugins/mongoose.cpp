@@ -1,4 +1,5 @@
 #include "openbr_internal.h"
+#include "openbr/core/metrics.h"
 #include <mongoose.h>
 
 namespace br
@@ -7,6 +8,20 @@ namespace br
 // This function will be called by mongoose on every new request.
 static int begin_request_handler(struct mg_connection *conn) {
   const struct mg_request_info *request_info = mg_get_request_info(conn);
+
+  // Prometheus scrape target
+  if (strcmp(request_info->uri, "/metrics") == 0) {
+    const QByteArray metrics = Metrics::toText().toUtf8();
+    mg_printf(conn,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: %d\r\n"
+              "\r\n",
+              metrics.size());
+    mg_write(conn, metrics.data(), metrics.size());
+    return 1;
+  }
+
   char content[100];
 
   // Prepare the message we're going to send
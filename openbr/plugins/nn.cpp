@@ -46,6 +46,17 @@ static void loadMLP(CvANN_MLP &mlp, QDataStream &stream)
     mlp.load(qPrintable(tempFile.fileName()));
 }
 
+// Adapts CvANN_MLP to predictBlocks()
+struct MLPPredictor
+{
+    const CvANN_MLP *mlp;
+
+    void predictBlock(const Mat &samples, Mat responses) const
+    {
+        mlp->predict(samples, responses);
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV's multi-layer perceptron framework
@@ -122,6 +133,27 @@ private:
         for (int i=0; i<outputVariables.size(); i++) dst.file.set(outputVariables.at(i),response.at<float>(0,i));
     }
 
+    // CvANN_MLP::predict evaluates each layer as one matrix product over every row of its input,
+    // so a block of stacked templates costs a GEMM per layer instead of a matrix-vector product per template.
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        const Mat samples = stackSamples(src);
+        if (samples.empty()) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        Mat responses(samples.rows, neuronsPerLayer.last(), CV_32FC1);
+        MLPPredictor predictor;
+        predictor.mlp = &mlp;
+        predictBlocks(&predictor, samples, responses);
+
+        dst = src;
+        for (int i=0; i<dst.size(); i++)
+            for (int j=0; j<outputVariables.size(); j++)
+                dst[i].file.set(outputVariables.at(j), responses.at<float>(i,j));
+    }
+
     void load(QDataStream &stream)
     {
         loadMLP(mlp,stream);
@@ -1,8 +1,12 @@
 #ifndef OPENBR_INTERNAL_H
 #define OPENBR_INTERNAL_H
 
+#include <QVector>
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include "openbr/openbr_plugin.h"
 #include "openbr/core/resource.h"
+#include <algorithm>
 
 namespace br
 {
@@ -459,6 +463,92 @@ protected:
     UntrainableMetadataTransform() : MetadataTransform(false) {}
 };
 
+/*!
+ * \brief A br::Distance that only accepts (0) or rejects (-FLOAT_MAX) pairs based on metadata.
+ *
+ * Such distances can resolve a query against an inverted index of the targets' metadata
+ * instead of being evaluated pair by pair, see PipeDistance.
+ */
+class MetadataFilterDistance : public Distance
+{
+    Q_OBJECT
+
+public:
+    /*!
+     * \brief Inverted index over one metadata key of a target list, ascending target indices for each distinct value.
+     *
+     * Every target appears under exactly one value, so an index holds one entry per target.
+     */
+    struct Index
+    {
+        QHash<QString, QVector<int> > values;
+    };
+
+    /*!
+     * \brief Index the targets for each of indexKeys(), keyed as in indexKeys().
+     */
+    QHash<QString, Index> index(const TemplateList &targets) const
+    {
+        QHash<QString, Index> indexes;
+        foreach (const QString &key, indexKeys()) {
+            Index &index = indexes[key];
+            for (int i=0; i<targets.size(); i++)
+                index.values[indexValue(targets[i].file, key)].append(i);
+        }
+        return indexes;
+    }
+
+    /*!
+     * \brief Whether \em indexes holds every key indexKeys() currently reads, which may change with Context::filters.
+     */
+    bool covers(const QHash<QString, Index> &indexes) const
+    {
+        foreach (const QString &key, indexKeys())
+            if (!indexes.contains(key))
+                return false;
+        return true;
+    }
+
+    /*!
+     * \brief Narrows \em candidates, ascending target indices, to the targets compare() accepts against \em query.
+     *
+     * While \em all is set \em candidates stands for every target, it is cleared once a key restricts them.
+     */
+    void select(const QHash<QString, Index> &indexes, const Template &query, QVector<int> &candidates, bool &all) const
+    {
+        foreach (const QString &key, indexKeys()) {
+            const Index index = indexes.value(key);
+            QVector<int> accepted;
+            QStringList values;
+            if (acceptedValues(key, query, values)) {
+                values.removeDuplicates();
+                foreach (const QString &value, values)
+                    accepted += index.values.value(value);
+            } else {
+                for (QHash<QString, QVector<int> >::const_iterator i = index.values.constBegin(); i != index.values.constEnd(); ++i)
+                    if (accepts(key, i.key(), query))
+                        accepted += i.value();
+            }
+            std::sort(accepted.begin(), accepted.end()); // Postings of distinct values are disjoint
+
+            if (all) {
+                candidates = accepted;
+                all = false;
+            } else {
+                QVector<int> both(std::min(candidates.size(), accepted.size()));
+                both.resize(std::set_intersection(candidates.begin(), candidates.end(), accepted.begin(), accepted.end(), both.begin()) - both.begin());
+                candidates = both;
+            }
+        }
+    }
+
+protected:
+    virtual QStringList indexKeys() const = 0; /*!< \brief Metadata keys read from target templates. */
+    virtual QString indexValue(const File &target, const QString &key) const { return target.get<QString>(key, ""); } /*!< \brief The categorical value of a key of a target. */
+    virtual bool accepts(const QString &key, const QString &value, const Template &query) const = 0; /*!< \brief Whether a target whose indexValue() for \em key is \em value passes against \em query. */
+    virtual bool acceptedValues(const QString &key, const Template &query, QStringList &values) const { (void) key; (void) query; (void) values; return false; } /*!< \brief Lists every value accepts() passes for \em key against \em query, so select() looks them up instead of testing each indexed value; returns false when they can't be listed. */
+};
+
 class FileGallery : public Gallery
 {
     Q_OBJECT
@@ -483,8 +573,19 @@ void applyAdditionalProperties(const File &temp, Transform *target);
 
 inline void splitFTEs(TemplateList &src, TemplateList  &ftes)
 {
-    TemplateList active = src;
-    src.clear();
+    // Leave the list untouched in the common case of no failures
+    bool anyFTE = false;
+    foreach (const Template &t, src)
+        if (t.file.fte) {
+            anyFTE = true;
+            break;
+        }
+    if (!anyFTE)
+        return;
+
+    TemplateList active;
+    active.swap(src);
+    src.reserve(active.size());
 
     foreach (const Template &t, active) {
         if (t.file.fte) {
@@ -495,6 +596,44 @@ inline void splitFTEs(TemplateList &src, TemplateList  &ftes)
     }
 }
 
+/*!
+ * \brief Stacks the matrix of each template as one row of a single precision matrix for batched prediction.
+ * \return An empty matrix if the templates can't be stacked, in which case they should be projected one at a time.
+ */
+inline cv::Mat stackSamples(const TemplateList &templates)
+{
+    if (templates.isEmpty() || templates.first().isEmpty())
+        return cv::Mat();
+
+    const size_t total = templates.first().m().total();
+    foreach (const Template &t, templates)
+        if (t.isEmpty() || (t.m().total() != total) || (t.m().type() != CV_32FC1) || !t.m().isContinuous())
+            return cv::Mat();
+
+    cv::Mat samples(templates.size(), total, CV_32FC1);
+    for (int i=0; i<templates.size(); i++)
+        memcpy(samples.ptr(i), templates[i].m().ptr(), total * sizeof(float));
+    return samples;
+}
+
+/*!
+ * \brief Evaluates <tt>predictor->predictBlock(const cv::Mat &samples, cv::Mat responses) const</tt> over blocks of rows in parallel.
+ *
+ * \em responses must be preallocated with one row per sample, each block writes to its own rows.
+ */
+template <typename Predictor>
+void predictBlocks(const Predictor *predictor, const cv::Mat &samples, cv::Mat &responses)
+{
+    const int blockSize = std::max(64, (samples.rows + Globals->parallelism - 1) / std::max(1, Globals->parallelism));
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<samples.rows; i+=blockSize) {
+        const cv::Range rows(i, std::min(i + blockSize, samples.rows));
+        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(predictor, &Predictor::predictBlock, samples.rowRange(rows), responses.rowRange(rows)));
+        else                          predictor->predictBlock(samples.rowRange(rows), responses.rowRange(rows));
+    }
+    futures.waitForFinished();
+}
+
 typedef QPair<int,float> Neighbor; // QPair<id,similarity>
 typedef QList<Neighbor> Neighbors;
 typedef QVector<Neighbors> Neighborhood;
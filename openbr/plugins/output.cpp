@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QAtomicInt>
+#include <QAtomicPointer>
 #include <QByteArray>
 #include <QCoreApplication>
 #include <QDebug>
@@ -23,14 +25,21 @@
 #include <QFileInfo>
 #include <QFutureSynchronizer>
 #include <QList>
+#include <QMap>
 #include <QMutex>
 #include <QPair>
+#include <QScopedPointer>
 #include <QVector>
 #include <QtConcurrent>
 #include <QtGlobal>
 #include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <functional>
 #include <iostream>
 #include <limits>
+#include <queue>
+#include <vector>
 #include <assert.h>
 #include "openbr_internal.h"
 
@@ -63,27 +72,236 @@ class DefaultOutput : public MatrixOutput
 
 BR_REGISTER(Output, DefaultOutput)
 
+/*!
+ * \ingroup outputs
+ * \brief Base class for text outputs that write each row of scores as soon as it is complete.
+ *
+ * Only rows still being compared are held in memory, so the full similarity matrix is never allocated.
+ * Rows are written in order through a buffered sink, out of order rows wait as formatted text.
+ * Every score is expected to be set exactly once.
+ */
+class RowOutput : public MatrixOutput
+{
+    Q_OBJECT
+
+    int rows, columns, nextRow;
+    QAtomicPointer<float> *pending; // Scores of rows in progress, allocated on first use
+    QAtomicInt *remaining;          // Scores left before each row is complete
+
+    QMutex lock;
+    QMap<int, QByteArray> completed; // Rows finished ahead of nextRow
+    QScopedPointer<QFile> sink;
+    QByteArray buffered;
+    bool opened;
+
+public:
+    RowOutput() : rows(0), columns(0), nextRow(0), pending(NULL), remaining(NULL), opened(false) {}
+
+    ~RowOutput()
+    {
+        release();
+    }
+
+protected:
+    virtual QByteArray header() const { return QByteArray(); }
+    virtual QByteArray formatRow(int row, const float *scores, int size) const = 0; /*!< \brief Returns the text for a row of \em size scores, including the trailing newline. */
+
+    // Locale-free and without the QString round trip, matches QString::number(float)
+    static QByteArray formatScore(float score)
+    {
+        return QByteArray::number(score);
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        allocate(queryFiles.size(), targetFiles.size());
+    }
+
+    void allocate(int rows, int columns)
+    {
+        release();
+        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) rows = columns = 0;
+        this->rows = rows;
+        this->columns = columns;
+        nextRow = 0;
+        pending = new QAtomicPointer<float>[rows];
+        remaining = new QAtomicInt[rows];
+        for (int i=0; i<rows; i++)
+            remaining[i].store(columns);
+    }
+
+    // Must be called by the derived destructor, formatRow() is unavailable afterwards
+    void finish()
+    {
+        if (rows == 0) return;
+
+        QMutexLocker locker(&lock);
+        for (; nextRow<rows; nextRow++) {
+            if (completed.contains(nextRow)) {
+                write(completed.take(nextRow));
+            } else {
+                float *scores = take(nextRow);
+                write(formatRow(nextRow, scores, columns));
+                delete[] scores;
+            }
+        }
+        close();
+    }
+
+private:
+    void setBlock(int rowBlock, int columnBlock)
+    {
+        // Some callers resize the matrix after initialization
+        if (!data.empty()) {
+            allocate(data.rows, data.cols);
+            data.release();
+        }
+        Output::setBlock(rowBlock, columnBlock);
+    }
+
+    void set(float value, int i, int j)
+    {
+        if (columns == 0) return;
+
+        // Address scores linearly like cv::Mat::at, some callers index a single column matrix by row 0
+        const qint64 index = qint64(i)*columns + j;
+        const int row = index / columns;
+        float *scores = pending[row].loadAcquire();
+        if (!scores) {
+            float *fresh = new float[columns];
+            std::fill(fresh, fresh+columns, -std::numeric_limits<float>::max());
+            if (pending[row].testAndSetOrdered(NULL, fresh)) {
+                scores = fresh;
+            } else {
+                delete[] fresh;
+                scores = pending[row].loadAcquire();
+            }
+        }
+
+        scores[index % columns] = value;
+        if (!remaining[row].deref())
+            complete(row);
+    }
+
+    void complete(int row)
+    {
+        // Format outside the lock so rows finishing on different threads don't serialize
+        float *scores = pending[row].fetchAndStoreOrdered(NULL);
+        const QByteArray text = formatRow(row, scores, columns);
+        delete[] scores;
+
+        QMutexLocker locker(&lock);
+        if (row != nextRow) {
+            completed.insert(row, text);
+            return;
+        }
+
+        write(text);
+        nextRow++;
+        while (completed.contains(nextRow))
+            write(completed.take(nextRow++));
+    }
+
+    float *take(int row)
+    {
+        float *scores = pending[row].fetchAndStoreOrdered(NULL);
+        if (!scores) {
+            scores = new float[columns];
+            std::fill(scores, scores+columns, -std::numeric_limits<float>::max());
+        }
+        return scores;
+    }
+
+    void write(const QByteArray &text)
+    {
+        if (!opened) {
+            opened = true;
+            const QString baseName = QFileInfo(file).baseName();
+            if ((baseName != "terminal") && (baseName != "buffer")) {
+                sink.reset(new QFile(file));
+                QtUtils::touchDir(*sink);
+                if (!sink->open(QFile::WriteOnly))
+                    qFatal("Failed to open %s for writing.", qPrintable(file));
+            }
+            buffered = header();
+        }
+
+        buffered.append(text);
+        if (buffered.size() >= (1 << 20))
+            flush();
+    }
+
+    void flush()
+    {
+        const QString baseName = QFileInfo(file).baseName();
+        if (baseName == "buffer") return; // Accumulates until close()
+        if (sink) sink->write(buffered);
+        else      fwrite(buffered.data(), 1, buffered.size(), stdout);
+        buffered.clear();
+    }
+
+    void close()
+    {
+        if (!opened) return;
+        if (QFileInfo(file).baseName() == "buffer") {
+            if (buffered.endsWith('\n')) buffered.chop(1);
+            Globals->buffer = buffered;
+        } else {
+            flush();
+        }
+        sink.reset();
+        buffered.clear();
+    }
+
+    void release()
+    {
+        for (int i=0; i<rows; i++)
+            delete[] pending[i].load();
+        delete[] pending;
+        delete[] remaining;
+        pending = NULL;
+        remaining = NULL;
+        rows = columns = 0;
+        completed.clear();
+    }
+};
+
 /*!
  * \ingroup outputs
  * \brief Comma separated values output.
  * \author Josh Klontz \cite jklontz
  */
-class csvOutput : public MatrixOutput
+class csvOutput : public RowOutput
 {
     Q_OBJECT
 
+    QList<QByteArray> queryNames;
+
     ~csvOutput()
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        QStringList lines;
-        lines.append("File," + targetFiles.names().join(","));
-        for (int i=0; i<queryFiles.size(); i++) {
-            QStringList words;
-            for (int j=0; j<targetFiles.size(); j++)
-                words.append(toString(i,j));  // The toString idiom is used to output match scores - see MatrixOutput
-            lines.append(queryFiles[i].name+","+words.join(","));
-        }
-        QtUtils::writeFile(file, lines);
+        finish();
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        RowOutput::initialize(targetFiles, queryFiles);
+        queryNames.clear();
+        foreach (const File &query, queryFiles)
+            queryNames.append(query.name.toLocal8Bit());
+    }
+
+    QByteArray header() const
+    {
+        return ("File," + targetFiles.names().join(",") + "\n").toLocal8Bit();
+    }
+
+    QByteArray formatRow(int row, const float *scores, int size) const
+    {
+        QByteArray line = queryNames[row];
+        for (int j=0; j<size; j++)
+            line += "," + formatScore(scores[j]);
+        return line + "\n";
     }
 };
 
@@ -94,7 +312,7 @@ BR_REGISTER(Output, csvOutput)
  * \brief Matrix-like output for heat maps.
  * \author Scott Klum \cite sklum
  */
-class heatOutput : public MatrixOutput
+class heatOutput : public RowOutput
 {
     Q_OBJECT
     Q_PROPERTY(int patches READ get_patches WRITE set_patches RESET reset_patches STORED false)
@@ -102,20 +320,20 @@ class heatOutput : public MatrixOutput
 
     ~heatOutput()
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-
-        QStringList lines;
-        for (int i=0; i<data.rows; i++) {
-            lines.append(toString(i,0));
-        }
-        QtUtils::writeFile(file, lines);
+        finish();
     }
 
     void initialize(const FileList &targetFiles, const FileList &queryFiles)
     {
         if (patches == -1) qFatal("Heat output requires the number of patches");
-        Output::initialize(targetFiles, queryFiles);
-        data.create(patches, 1, CV_32FC1);
+        RowOutput::initialize(targetFiles, queryFiles);
+        allocate(patches, 1);
+    }
+
+    QByteArray formatRow(int row, const float *scores, int size) const
+    {
+        (void) row; (void) size;
+        return formatScore(scores[0]) + "\n";
     }
 };
 
@@ -126,42 +344,58 @@ BR_REGISTER(Output, heatOutput)
  * \brief One score per row.
  * \author Josh Klontz \cite jklontz
  */
-class meltOutput : public MatrixOutput
+class meltOutput : public RowOutput
 {
     Q_OBJECT
 
+    bool genuineOnly, impostorOnly;
+    QByteArray keys, values;
+    QList<QByteArray> queryNames, targetNames;
+    QList<QString> queryLabels, targetLabels;
+
     ~meltOutput()
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const bool genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
-        const bool impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
+        finish();
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        RowOutput::initialize(targetFiles, queryFiles);
+        genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
+        impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
 
         QMap<QString,QVariant> args = file.localMetadata();
         args.remove("Genuine");
         args.remove("Impostor");
 
-        QString keys; foreach (const QString &key, args.keys()) keys += "," + key;
-        QString values; foreach (const QVariant &value, args.values()) values += "," + value.toString();
+        keys.clear(); foreach (const QString &key, args.keys()) keys += "," + key.toLocal8Bit();
+        values.clear(); foreach (const QVariant &value, args.values()) values += "," + value.toString().toLocal8Bit();
 
-        QStringList lines;
-        if (file.baseName() != "terminal") lines.append(QString("Query,Target,Mask,Similarity%1").arg(keys));
+        queryNames.clear(); foreach (const File &query, queryFiles) queryNames.append(query.name.toLocal8Bit());
+        targetNames.clear(); foreach (const File &target, targetFiles) targetNames.append(target.name.toLocal8Bit());
+        queryLabels = File::get<QString>(queryFiles, "Label");
+        targetLabels = File::get<QString>(targetFiles, "Label");
+    }
 
-        QList<QString> queryLabels = File::get<QString>(queryFiles, "Label");
-        QList<QString> targetLabels = File::get<QString>(targetFiles, "Label");
+    QByteArray header() const
+    {
+        if (file.baseName() == "terminal") return QByteArray();
+        return "Query,Target,Mask,Similarity" + keys + "\n";
+    }
 
-        for (int i=0; i<queryFiles.size(); i++) {
-            for (int j=(selfSimilar ? i+1 : 0); j<targetFiles.size(); j++) {
-                const bool genuine = queryLabels[i] == targetLabels[j];
-                if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
-                lines.append(QString("%1,%2,%3,%4%5").arg(queryFiles[i],
-                                                          targetFiles[j],
-                                                          QString::number(genuine),
-                                                          QString::number(data.at<float>(i,j)),
-                                                          values));
-            }
+    QByteArray formatRow(int row, const float *scores, int size) const
+    {
+        QByteArray lines;
+        for (int j=(selfSimilar ? row+1 : 0); j<size; j++) {
+            const bool genuine = queryLabels[row] == targetLabels[j];
+            if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
+            lines.append(queryNames[row]).append(',')
+                 .append(targetNames[j]).append(',')
+                 .append(genuine ? '1' : '0').append(',')
+                 .append(formatScore(scores[j]))
+                 .append(values).append('\n');
         }
-
-        QtUtils::writeFile(file, lines);
+        return lines;
     }
 };
 
@@ -257,41 +491,63 @@ BR_REGISTER(Output, mtxOutput)
 /*!
  * \ingroup outputs
  * \brief Rank retrieval output.
+ *
+ * Each row is reduced to its best \em limit scores as soon as it is complete.
  * \author Josh Klontz \cite jklontz
  * \author Scott Klum \cite sklum
  */
-class rrOutput : public MatrixOutput
+class rrOutput : public RowOutput
 {
     Q_OBJECT
 
+    int limit;
+    bool byLine, simple;
+    float threshold;
+
     ~rrOutput()
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const int limit = file.get<int>("limit", 20);
-        const bool byLine = file.getBool("byLine");
-        const bool simple = file.getBool("simple");
-        const float threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
+        finish();
+    }
 
-        QStringList lines;
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        RowOutput::initialize(targetFiles, queryFiles);
+        limit = file.get<int>("limit", 20);
+        byLine = file.getBool("byLine");
+        simple = file.getBool("simple");
+        threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
+    }
 
-        for (int i=0; i<queryFiles.size(); i++) {
-            QStringList files;
-            if (simple) files.append(queryFiles[i].fileName());
+    QByteArray formatRow(int row, const float *scores, int size) const
+    {
+        // Bounded min-heap, ranks ties like Common::Sort
+        typedef QPair<float,int> Pair;
+        std::priority_queue< Pair, std::vector<Pair>, std::greater<Pair> > best;
+        for (int j=0; j<size; j++) {
+            const Pair pair(scores[j], j);
+            if (int(best.size()) < limit) best.push(pair);
+            else if ((limit > 0) && (best.top() < pair)) { best.pop(); best.push(pair); }
+        }
 
-            typedef QPair<float,int> Pair;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true, limit)) {
-                if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
-                    if (pair.first < threshold) break;
-                    File target = targetFiles[pair.second];
-                    target.set("Score", QString::number(pair.first));
-                    if (simple) files.append(target.fileName() + " " + QString::number(pair.first));
-                    else files.append(target.flat());
-                }
-            }
-            lines.append(files.join(byLine ? "\n" : ","));
+        QVector<Pair> ranked(best.size());
+        for (int k=ranked.size()-1; k>=0; k--) {
+            ranked[k] = best.top();
+            best.pop();
         }
 
-        QtUtils::writeFile(file, lines);
+        QStringList files;
+        if (simple) files.append(queryFiles[row].fileName());
+
+        foreach (const Pair &pair, ranked) {
+            if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[row].get<int>("Partition",-1)) : true) {
+                if (pair.first < threshold) break;
+                File target = targetFiles[pair.second];
+                target.set("Score", QString::number(pair.first));
+                if (simple) files.append(target.fileName() + " " + QString::number(pair.first));
+                else files.append(target.flat());
+            }
+        }
+        return (files.join(byLine ? "\n" : ",") + "\n").toLocal8Bit();
     }
 };
 
@@ -1,5 +1,7 @@
 #include <QFutureSynchronizer>
 #include <QtConcurrent>
+#include <algorithm>
+#include <functional>
 #include "openbr_internal.h"
 
 #include "openbr/core/common.h"
@@ -284,6 +286,164 @@ class ZScoreDistance : public Distance
 
 BR_REGISTER(Distance, ZScoreDistance)
 
+/*!
+ * \ingroup transforms
+ * \brief Stores statistics of a template's scores against an impostor cohort for CohortNormDistance.
+ *
+ * The cohort is a sample of at most \em cohortSize training templates.
+ * Statistics are computed once at enrollment, in one parallel comparison per block of templates,
+ * and stored as \c CohortMean, \c CohortStdDev and \c CohortTopK (the mean of the \em k highest scores).
+ * Cohort members sharing the template's \em inputVariable are excluded.
+ */
+class CohortStatisticsTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(int cohortSize READ get_cohortSize WRITE set_cohortSize RESET reset_cohortSize STORED false)
+    Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k STORED false)
+    Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    BR_PROPERTY(br::Distance*, distance, Distance::make("Dist(L2)", this))
+    BR_PROPERTY(int, cohortSize, 1000)
+    BR_PROPERTY(int, k, 10)
+    BR_PROPERTY(QString, inputVariable, "Label")
+
+    TemplateList cohort;
+    QStringList cohortLabels;
+
+    void train(const TemplateList &data)
+    {
+        distance->train(data);
+
+        cohort.clear();
+        if (data.size() <= cohortSize) {
+            cohort = data;
+        } else {
+            Common::seedRNG();
+            foreach (int index, Common::RandSample(cohortSize, data.size(), 0, true))
+                cohort.append(data[index]);
+        }
+        cohortLabels = File::get<QString>(cohort.files(), inputVariable, "");
+    }
+
+    void setStatistics(const float *scores, Template &dst) const
+    {
+        const QString label = dst.file.get<QString>(inputVariable, "");
+        QList<float> impostors; impostors.reserve(cohort.size());
+        for (int i=0; i<cohort.size(); i++)
+            if ((scores[i] != -std::numeric_limits<float>::max()) && (label.isEmpty() || (cohortLabels[i] != label)))
+                impostors.append(scores[i]);
+        if (impostors.isEmpty())
+            return;
+
+        double mean, stddev;
+        Common::MeanStdDev(impostors, &mean, &stddev);
+        const int n = std::min(k, impostors.size());
+        std::partial_sort(impostors.begin(), impostors.begin()+n, impostors.end(), std::greater<float>());
+        double topK = 0;
+        for (int i=0; i<n; i++)
+            topK += impostors[i];
+
+        dst.file.set("CohortMean", mean);
+        dst.file.set("CohortStdDev", stddev);
+        dst.file.set("CohortTopK", topK/n);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        const QList<float> scores = distance->compare(cohort, src);
+        setStatistics(scores.toVector().constData(), dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        dst = src;
+        if (src.isEmpty() || cohort.isEmpty())
+            return;
+
+        QScopedPointer<MatrixOutput> scores(MatrixOutput::make(FileList(cohort.size()), FileList(src.size())));
+        distance->compare(cohort, src, scores.data());
+        for (int i=0; i<dst.size(); i++)
+            setStatistics(scores->data.ptr<float>(i), dst[i]);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        distance->store(stream);
+        stream << cohort;
+    }
+
+    void load(QDataStream &stream)
+    {
+        distance->load(stream);
+        stream >> cohort;
+        cohortLabels = File::get<QString>(cohort.files(), inputVariable, "");
+    }
+};
+
+BR_REGISTER(Transform, CohortStatisticsTransform)
+
+/*!
+ * \ingroup distances
+ * \brief Normalizes scores by the cohort statistics CohortStatisticsTransform stored with each template.
+ *
+ * \em ZNorm standardizes by the target's impostor mean and deviation, \em TopK subtracts the mean of
+ * the target's top cohort scores, and \em SNorm averages the target and query ZNorm scores.
+ * Templates without statistics are compared unnormalized.
+ */
+class CohortNormDistance : public Distance
+{
+    Q_OBJECT
+    Q_ENUMS(Method)
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(Method method READ get_method WRITE set_method RESET reset_method STORED false)
+
+public:
+    /*!< */
+    enum Method { ZNorm,
+                  TopK,
+                  SNorm };
+
+private:
+    BR_PROPERTY(br::Distance*, distance, make("Dist(L2)"))
+    BR_PROPERTY(Method, method, ZNorm)
+
+    void train(const TemplateList &src)
+    {
+        distance->train(src);
+    }
+
+    static float zNorm(float score, const File &file)
+    {
+        const float stddev = file.get<float>("CohortStdDev", 0);
+        return stddev > 0 ? (score - file.get<float>("CohortMean", 0)) / stddev : score;
+    }
+
+    float compare(const Template &target, const Template &query) const
+    {
+        const float score = distance->compare(target, query);
+        if ((score == -std::numeric_limits<float>::max()) || !target.file.contains("CohortMean"))
+            return score;
+
+        if (method == ZNorm) return zNorm(score, target.file);
+        if (method == TopK)  return score - target.file.get<float>("CohortTopK", 0);
+        if (!query.file.contains("CohortMean")) return zNorm(score, target.file);
+        return (zNorm(score, target.file) + zNorm(score, query.file)) / 2;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        distance->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        distance->load(stream);
+    }
+};
+
+BR_REGISTER(Distance, CohortNormDistance)
+
 /*!
  * \ingroup distances
  * \brief 1v1 heat map comparison
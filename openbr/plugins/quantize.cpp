@@ -19,6 +19,7 @@
 #include "openbr_internal.h"
 
 #include "openbr/core/common.h"
+#include "openbr/core/distance_sse.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/qtutils.h"
 
@@ -48,6 +49,25 @@ class QuantizeTransform : public Transform
         b = -a*minVal;
     }
 
+    bool incrementalTraining() const
+    {
+        return true;
+    }
+
+    void trainBlock(const TemplateList &block, bool first)
+    {
+        double minVal, maxVal;
+        minMaxLoc(OpenCVUtils::toMat(block.data()), &minVal, &maxVal);
+        if (!first) {
+            // Widen the range seen so far
+            const double previousMin = -b/a;
+            minVal = std::min(minVal, previousMin);
+            maxVal = std::max(maxVal, previousMin + 255.0/a);
+        }
+        a = 255.0/(maxVal-minVal);
+        b = -a*minVal;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         src.m().convertTo(dst, CV_8U, a, b);
@@ -244,6 +264,151 @@ class PackTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, PackTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Approximate floats as symmetric int8 with a calibrated scale.
+ *
+ * Values are scaled so that their \em percentile absolute value maps to 127, clipping outliers.
+ * The default single scale preserves angles up to rounding, so Int8DotDistance approximates float cosine similarity.
+ * With \em perDimension each dimension gets its own scale, which weights dimension i by its squared scale in the dot product,
+ * so Int8DotDistance no longer returns cosine similarity; training reports how often the rank-one neighbor still agrees with it.
+ * The output is the int8 values followed by a 1x1 CV_32FC1 matrix holding their inverse norm, so cosine comparisons only need one dot product.
+ */
+class Int8QuantizeTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(float percentile READ get_percentile WRITE set_percentile RESET reset_percentile STORED false)
+    Q_PROPERTY(bool perDimension READ get_perDimension WRITE set_perDimension RESET reset_perDimension STORED false)
+    BR_PROPERTY(float, percentile, 0.999)
+    BR_PROPERTY(bool, perDimension, false)
+
+    QVector<float> scales;
+
+    static float calibrate(const Mat &data, float percentile)
+    {
+        QList<float> vals = OpenCVUtils::matrixToVector<float>(Mat(cv::abs(data)));
+        if (vals.isEmpty())
+            return 1;
+        std::sort(vals.begin(), vals.end());
+        const float limit = vals[std::min(vals.size()-1, int(percentile*vals.size()))];
+        return limit > 0 ? 127/limit : 1;
+    }
+
+    static void calibrateDimension(const Mat &data, float percentile, float *scale)
+    {
+        *scale = calibrate(data, percentile);
+    }
+
+    void quantize(const float *src, signed char *dst) const
+    {
+        for (int i=0; i<scales.size(); i++)
+            dst[i] = std::max(-127, std::min(127, cvRound(src[i]*scales[i])));
+    }
+
+    // Fraction of samples whose nearest neighbor under float cosine similarity is also nearest after quantization
+    float recall(const Mat &data) const
+    {
+        const int n = std::min(data.rows, 1000);
+        if (n < 2) return 1;
+
+        Mat floats(n, data.cols, CV_32FC1), ints(n, data.cols, CV_8SC1);
+        QVector<int> norms(n);
+        for (int i=0; i<n; i++) {
+            Mat row = floats.row(i);
+            normalize(data.row(i), row);
+            quantize(data.ptr<float>(i), ints.ptr<signed char>(i));
+            norms[i] = dot_s8(ints.ptr<signed char>(i), ints.ptr<signed char>(i), data.cols);
+        }
+
+        int hits = 0;
+        for (int i=0; i<n; i++) {
+            int floatBest = -1, intBest = -1;
+            double floatBestScore = -std::numeric_limits<double>::max(), intBestScore = -std::numeric_limits<double>::max();
+            for (int j=0; j<n; j++) {
+                if (i == j) continue;
+                const double floatScore = floats.row(i).dot(floats.row(j));
+                const double intScore = dot_s8(ints.ptr<signed char>(i), ints.ptr<signed char>(j), data.cols) / std::sqrt(std::max(1.0, double(norms[i])*norms[j]));
+                if (floatScore > floatBestScore) { floatBestScore = floatScore; floatBest = j; }
+                if (intScore > intBestScore) { intBestScore = intScore; intBest = j; }
+            }
+            if (floatBest == intBest) hits++;
+        }
+        return float(hits)/n;
+    }
+
+    void train(const TemplateList &src)
+    {
+        const Mat data = OpenCVUtils::toMat(src.data());
+        if (data.type() != CV_32FC1)
+            qFatal("Expected CV_32FC1 templates.");
+
+        scales = QVector<float>(data.cols);
+        if (perDimension) {
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<data.cols; i++)
+                futures.addFuture(QtConcurrent::run(&Int8QuantizeTransform::calibrateDimension, data.col(i), percentile, &scales.data()[i]));
+            futures.waitForFinished();
+        } else {
+            scales.fill(calibrate(data, percentile));
+        }
+
+        qDebug("Int8 quantization rank-one recall against float: %.3f", recall(data));
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat m = src.m().isContinuous() ? src.m() : src.m().clone();
+        if ((m.type() != CV_32FC1) || (int(m.total()) != scales.size()))
+            qFatal("Expected %d dimensional CV_32FC1 template.", scales.size());
+        Mat quantized(1, scales.size(), CV_8SC1);
+        quantize(m.ptr<float>(), quantized.ptr<signed char>());
+
+        const int norm = dot_s8(quantized.ptr<signed char>(), quantized.ptr<signed char>(), scales.size());
+        dst = Template(src.file, quantized);
+        dst.append(Mat(1, 1, CV_32FC1, Scalar((norm > 0) ? 1 / std::sqrt(float(norm)) : 0)));
+    }
+
+    void store(QDataStream &stream) const
+    {
+        stream << scales;
+    }
+
+    void load(QDataStream &stream)
+    {
+        stream >> scales;
+    }
+};
+
+BR_REGISTER(Transform, Int8QuantizeTransform)
+
+/*!
+ * \ingroup distances
+ * \brief Cosine similarity, or the raw dot product, of int8 templates using integer multiply-accumulate.
+ * \see Int8QuantizeTransform
+ */
+class Int8DotDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(bool cosine READ get_cosine WRITE set_cosine RESET reset_cosine STORED false)
+    BR_PROPERTY(bool, cosine, true)
+
+    float compare(const Template &a, const Template &b) const
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return -std::numeric_limits<float>::max(); // Failure to enroll
+        if ((a.size() != 2) || (b.size() != 2) || (a[0].type() != CV_8SC1) || (b[0].type() != CV_8SC1) || (a[0].total() != b[0].total()) || (a[1].type() != CV_32FC1) || (b[1].type() != CV_32FC1))
+            qFatal("Expected matching templates from Int8Quantize.");
+
+        const int dot = dot_s8(a[0].ptr<signed char>(), b[0].ptr<signed char>(), a[0].total());
+        if (!cosine) return dot;
+
+        // Inverse norms were computed once at quantization
+        return dot * a[1].at<float>(0) * b[1].at<float>(0);
+    }
+};
+
+BR_REGISTER(Distance, Int8DotDistance)
+
 QVector<Mat> ProductQuantizationLUTs;
 
 /*!
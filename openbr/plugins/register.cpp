@@ -120,6 +120,115 @@ private:
 };
 BR_REGISTER(Transform, AffineTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Registers chips directly from the original image.
+ * \see AffineTransform
+ *
+ * Replaces <tt>RestoreMat(original)+Affine(...)</tt> at the end of a registration pipeline that detects and landmarks
+ * a reduced copy of the image, such as <tt>SaveMat(original)+LimitSize(...)+Cvt(Gray)+Cascade+ASEFEyes</tt>.
+ * Landmarks found on the working image are scaled to the original stored in \em original and composed with the registration into one affine map,
+ * so each chip samples only its own pixels from the original and no full frame intermediate is created.
+ * When \em pointsPerFace is positive, every group of that many points produces a chip, allowing many faces per frame in one call.
+ * Faces without landmarks are registered from their rects, chips are appended in order and can be split into templates with Expand.
+ */
+class ChipTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_ENUMS(br::AffineTransform::Method)
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(float x1 READ get_x1 WRITE set_x1 RESET reset_x1 STORED false)
+    Q_PROPERTY(float y1 READ get_y1 WRITE set_y1 RESET reset_y1 STORED false)
+    Q_PROPERTY(float x2 READ get_x2 WRITE set_x2 RESET reset_x2 STORED false)
+    Q_PROPERTY(float y2 READ get_y2 WRITE set_y2 RESET reset_y2 STORED false)
+    Q_PROPERTY(float x3 READ get_x3 WRITE set_x3 RESET reset_x3 STORED false)
+    Q_PROPERTY(float y3 READ get_y3 WRITE set_y3 RESET reset_y3 STORED false)
+    Q_PROPERTY(br::AffineTransform::Method method READ get_method WRITE set_method RESET reset_method STORED false)
+    Q_PROPERTY(QString original READ get_original WRITE set_original RESET reset_original STORED false)
+    Q_PROPERTY(int pointsPerFace READ get_pointsPerFace WRITE set_pointsPerFace RESET reset_pointsPerFace STORED false)
+    BR_PROPERTY(int, width, 64)
+    BR_PROPERTY(int, height, 64)
+    BR_PROPERTY(float, x1, 0)
+    BR_PROPERTY(float, y1, 0)
+    BR_PROPERTY(float, x2, -1)
+    BR_PROPERTY(float, y2, -1)
+    BR_PROPERTY(float, x3, -1)
+    BR_PROPERTY(float, y3, -1)
+    BR_PROPERTY(AffineTransform::Method, method, AffineTransform::Bilin)
+    BR_PROPERTY(QString, original, "original")
+    BR_PROPERTY(int, pointsPerFace, 0)
+
+    static Point2f getThirdAffinePoint(const Point2f &a, const Point2f &b)
+    {
+        float dx = b.x - a.x;
+        float dy = b.y - a.y;
+        return Point2f(a.x - dy, a.y + dx);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat &working = src.m();
+        const Mat image = src.file.get<Mat>(original, working);
+        const float sx = float(image.cols) / working.cols;
+        const float sy = float(image.rows) / working.rows;
+        const bool twoPoints = ((x3 == -1) || (y3 == -1));
+
+        Point2f dstPoints[3];
+        dstPoints[0] = Point2f(x1*width, y1*height);
+        dstPoints[1] = Point2f((x2 == -1 ? 1 - x1 : x2)*width, (y2 == -1 ? y1 : y2)*height);
+        if (twoPoints) dstPoints[2] = getThirdAffinePoint(dstPoints[0], dstPoints[1]);
+        else           dstPoints[2] = Point2f(x3*width, y3*height);
+
+        // Each entry is the three source points of one chip in original image coordinates
+        QList< QVector<Point2f> > faces;
+        const QList<QPointF> points = src.file.points();
+        const int required = twoPoints ? 2 : 3;
+        const int step = (pointsPerFace > 0) ? pointsPerFace : points.size();
+        const bool landmarks = (step >= required) && (points.size() >= required);
+        if (landmarks) {
+            for (int i=0; i+step<=points.size(); i+=step) {
+                QVector<Point2f> face(3);
+                for (int j=0; j<required; j++)
+                    face[j] = Point2f(points[i+j].x()*sx, points[i+j].y()*sy);
+                if (twoPoints) face[2] = getThirdAffinePoint(face[0], face[1]);
+                faces.append(face);
+            }
+        } else {
+            // Without landmarks the rect is scaled to fill the chip
+            foreach (const QRectF &rect, src.file.rects()) {
+                QVector<Point2f> face(3);
+                face[0] = Point2f(rect.left()*sx, rect.top()*sy);
+                face[1] = Point2f(rect.right()*sx, rect.top()*sy);
+                face[2] = Point2f(rect.left()*sx, rect.bottom()*sy);
+                faces.append(face);
+            }
+            dstPoints[0] = Point2f(0, 0);
+            dstPoints[1] = Point2f(width, 0);
+            dstPoints[2] = Point2f(0, height);
+        }
+
+        dst.file = src.file;
+        dst.file.remove(original);
+        if (faces.isEmpty()) {
+            resize(image, dst, Size(width, height));
+            return;
+        }
+
+        if (landmarks && (faces.size() == 1))
+            for (int i=0; i<required; i++)
+                dst.file.set("Affine_" + QString::number(i), OpenCVUtils::fromPoint(faces.first()[i]));
+
+        foreach (const QVector<Point2f> &face, faces) {
+            Mat chip;
+            warpAffine(image, chip, getAffineTransform(face.data(), dstPoints), Size(width, height), method);
+            dst.append(chip);
+        }
+    }
+};
+
+BR_REGISTER(Transform, ChipTransform)
+
 /*!
  * \ingroup transforms
  * \brief Flips the image about an axis.
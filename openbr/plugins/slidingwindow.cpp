@@ -1,3 +1,5 @@
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include "openbr_internal.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/common.h"
@@ -107,27 +109,55 @@ private:
             return;
         }
 
-        Template windowTemplate(src.file, src);
+        // Windows are classified in batches so the wrapped transform sees whole lists,
+        // one row at a time when takeFirst needs to stop early, otherwise the whole scale at once.
         QList<float> confidences = dst.file.getList<float>("Confidences", QList<float>());
+        TemplateList batch;
+        QList<QRectF> windows;
         for (float y = 0; y + windowHeight < src.m().rows; y += windowHeight*stepFraction) {
             for (float x = 0; x + windowWidth < src.m().cols; x += windowWidth*stepFraction) {
-                Mat windowMat(src, Rect(x + ignoreBorder, y + ignoreBorder, windowWidth - ignoreBorder * 2, windowHeight - ignoreBorder * 2));
-                windowTemplate.replace(0,windowMat);
-                Template detect;
-                transform->project(windowTemplate, detect);
-                float conf = detect.m().at<float>(0);
-
-                // the result will be in the Label
-                if (conf > threshold) {
-                    dst.file.appendRect(QRectF(x*scale, y*scale, windowWidth*scale, windowHeight*scale));
-                    confidences.append(conf);
-                    if (takeFirst)
-                        return;
-                }
+                batch.append(Template(src.file, Mat(src, Rect(x + ignoreBorder, y + ignoreBorder, windowWidth - ignoreBorder * 2, windowHeight - ignoreBorder * 2))));
+                windows.append(QRectF(x*scale, y*scale, windowWidth*scale, windowHeight*scale));
             }
+
+            if (takeFirst && classify(batch, windows, dst, confidences))
+                return;
         }
+        classify(batch, windows, dst, confidences);
         dst.file.setList<float>("Confidences", confidences);
     }
+
+private:
+    // Returns true if takeFirst is satisfied
+    bool classify(TemplateList &batch, QList<QRectF> &windows, Template &dst, QList<float> &confidences) const
+    {
+        TemplateList detections;
+        transform->project(batch, detections);
+        if (detections.size() != batch.size()) {
+            // The wrapped transform changed the list structure, fall back to one window at a time
+            detections.clear();
+            foreach (const Template &window, batch) {
+                Template detect;
+                transform->project(window, detect);
+                detections.append(detect);
+            }
+        }
+
+        bool found = false;
+        for (int i=0; i<detections.size() && !found; i++) {
+            const float conf = detections[i].m().at<float>(0);
+
+            // the result will be in the Label
+            if (conf > threshold) {
+                dst.file.appendRect(windows[i]);
+                confidences.append(conf);
+                found = takeFirst;
+            }
+        }
+        batch.clear();
+        windows.clear();
+        return found;
+    }
 };
 
 BR_REGISTER(Transform, SlidingWindowTransform)
@@ -279,14 +309,49 @@ private:
         else
             startScale = qRound((float) cols / (float) windowWidth);
 
-        for (float scale = startScale; scale >= minScale; scale -= (1.0 - scaleFactor)) {
-            Template scaleImg(dst.file, Mat());
-            scaleImg.file.set("scale", scale);
-            resize(src, scaleImg, Size(qRound(cols / scale), qRound(rows / scale)));
-            transform->project(scaleImg, dst);
-            if (takeLargestScale && !dst.file.rects().empty())
-                return;
+        QList<float> scales;
+        for (float scale = startScale; scale >= minScale; scale -= (1.0 - scaleFactor))
+            scales.append(scale);
+
+        if (takeLargestScale) {
+            foreach (float scale, scales) {
+                projectScale(scale, &src, &dst);
+                if (!dst.file.rects().empty())
+                    return;
+            }
+            return;
         }
+
+        // Scales are independent, so search them concurrently and merge the detections in scale order
+        QVector<Template> results(scales.size(), Template(src.file));
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<scales.size(); i++)
+            if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(this, &BuildScalesTransform::projectScale, scales[i], &src, &results[i]));
+            else                          projectScale(scales[i], &src, &results[i]);
+        futures.waitForFinished();
+
+        // File::rects() rounds to integers, the detections are merged as the QRectFs SlidingWindow appended
+        QList<QRectF> rects = src.file.getList<QRectF>("Rects", QList<QRectF>());
+        QList<float> confidences = src.file.getList<float>("Confidences", QList<float>());
+        const int existingRects = rects.size();
+        const int existingConfidences = confidences.size();
+        foreach (const Template &result, results) {
+            rects.append(result.file.getList<QRectF>("Rects", QList<QRectF>()).mid(existingRects));
+            confidences.append(result.file.getList<float>("Confidences", QList<float>()).mid(existingConfidences));
+        }
+        if (!results.isEmpty())
+            dst = results.last();
+        dst.file.setRects(rects);
+        if (!confidences.isEmpty())
+            dst.file.setList<float>("Confidences", confidences);
+    }
+
+    void projectScale(float scale, const Template *src, Template *dst) const
+    {
+        Template scaleImg(dst->file, Mat());
+        scaleImg.file.set("scale", scale);
+        resize(*src, scaleImg, Size(qRound(src->m().cols / scale), qRound(src->m().rows / scale)));
+        transform->project(scaleImg, *dst);
     }
 
     void store(QDataStream &stream) const
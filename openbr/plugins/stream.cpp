@@ -1,4 +1,5 @@
 #include <fstream>
+#include <QElapsedTimer>
 #include <QReadWriteLock>
 #include <QWaitCondition>
 #include <QThreadPool>
@@ -10,6 +11,8 @@
 #include <opencv2/highgui/highgui.hpp>
 #include "openbr_internal.h"
 #include "openbr/core/common.h"
+#include "openbr/core/metrics.h"
+#include "openbr/core/numa.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/qtutils.h"
 
@@ -35,6 +38,16 @@ class FrameData
 public:
     int sequenceNumber;
     TemplateList data;
+
+    // Takes ownership of a stage's output followed by its failures, without
+    // leaving a second reference behind that would force later detaches
+    void replaceData(TemplateList &output, const TemplateList &ftes)
+    {
+        data.swap(output);
+        output.clear();
+        if (!ftes.empty())
+            data.append(ftes);
+    }
 };
 
 // A buffer shared between adjacent processing stages in a stream
@@ -229,6 +242,16 @@ struct StreamGallery : public TemplateProcessor
         return galleryOk;
     }
 
+    StreamGallery() : adaptiveReads(false) {}
+
+    // Scale the read block size to keep each read between roughly 10 and 250ms
+    bool adaptiveReads;
+
+    int readBlockSize() const
+    {
+        return gallery.isNull() ? 0 : gallery->readBlockSize;
+    }
+
     bool isOpen() { return galleryOk; }
 
     void close()
@@ -243,8 +266,18 @@ struct StreamGallery : public TemplateProcessor
     {
         // If we still have data available, we return one of those
         if ((nextIdx >= currentData.size()) && !lastBlock) {
+            QElapsedTimer timer;
+            timer.start();
             currentData = gallery->readBlock(&lastBlock);
             nextIdx = 0;
+
+            if (adaptiveReads) {
+                const qint64 elapsed = timer.elapsed();
+                if ((elapsed < 10) && (gallery->readBlockSize < 10000) && (currentData.size() == gallery->readBlockSize))
+                    gallery->readBlockSize *= 2;
+                else if ((elapsed > 250) && (gallery->readBlockSize > 1))
+                    gallery->readBlockSize /= 2;
+            }
         }
 
         if (nextIdx >= currentData.size()) {
@@ -252,8 +285,10 @@ struct StreamGallery : public TemplateProcessor
             return false;
         }
 
-        // Return the indicated template, and advance the index
-        output = currentData[nextIdx++];
+        // Return the indicated template and drop our reference to it, so the
+        // frame owns its data outright
+        output = currentData[nextIdx];
+        currentData[nextIdx++] = Template();
         return true;
     }
 
@@ -297,6 +332,7 @@ public:
         if (!data_ok)
             return false;
         output = basis;
+        basis = Template();
         data_ok = false;
         return true;
     }
@@ -321,6 +357,8 @@ public:
             allFrames.addItem(new FrameData());
         }
         frameSource = NULL;
+        frameCount.store(maxFrames);
+        adaptiveReads = false;
     }
 
     virtual ~DataSource()
@@ -349,6 +387,26 @@ public:
         return this->templates.size();
     }
 
+    // Raise the number of frames that may be in flight at once
+    void addFrames(int count)
+    {
+        for (int i=0; i < count; i++)
+            allFrames.addItem(new FrameData());
+        frameCount.fetchAndAddOrdered(count);
+    }
+
+    int frames() const { return frameCount.load(); }
+    int returnedFrames() const { return returned.load(); }
+    int starvedReads() const { return starved.load(); }
+
+    int readBlockSize() const
+    {
+        const StreamGallery *gallery = dynamic_cast<const StreamGallery*>(frameSource);
+        return gallery ? gallery->readBlockSize() : 0;
+    }
+
+    bool adaptiveReads;
+
     bool open(const TemplateList &input, br::Idiocy::StreamModes _mode)
     {
         // Set up variables specific to us
@@ -391,8 +449,10 @@ public:
         // Try to get a FrameData from the pool, if we can't it means too many
         // frames are already out, and we will return NULL to indicate failure
         FrameData *aFrame = allFrames.tryGetItem();
-        if (aFrame == NULL)
+        if (aFrame == NULL) {
+            starved.ref();
             return NULL;
+        }
 
         // Try to actually read a frame, if this returns false the data source is broken
         bool res = getNextFrame(*aFrame);
@@ -423,6 +483,7 @@ public:
         inputFrame->data.clear();
         inputFrame->sequenceNumber = -1;
         allFrames.addItem(inputFrame);
+        returned.ref();
 
         bool rval = false;
 
@@ -476,8 +537,11 @@ protected:
             }
             else if (mode == br::Idiocy::StreamGallery)
             {
-                if (!frameSource)
-                    frameSource = new StreamGallery();
+                if (!frameSource) {
+                    StreamGallery *gallery = new StreamGallery();
+                    gallery->adaptiveReads = adaptiveReads;
+                    frameSource = gallery;
+                }
             }
             open_res = frameSource->open(curr);
             if (!open_res)
@@ -504,9 +568,10 @@ protected:
             if (got_frame) {
                 // set the sequence number and tempalte of this frame
                 output.sequenceNumber = next_sequence_number;
+                // set the frame number in the template's metadata while it
+                // has a single owner, so the metadata isn't detached
+                aTemplate.file.set("FrameNumber", output.sequenceNumber);
                 output.data.append(aTemplate);
-                // set the frame number in the template's metadata
-                output.data.last().file.set("FrameNumber", output.sequenceNumber);
                 next_sequence_number++;
                 return true;
             }
@@ -544,11 +609,105 @@ protected:
     bool allReturned;
 
     DoubleBuffer allFrames;
+    QAtomicInt frameCount;
+    QAtomicInt returned;
+    QAtomicInt starved;
 
     QWaitCondition lastReturned;
     QMutex last_frame_update;
 };
 
+// Tunes a stream's thread pool size and in-flight frame limit during its first
+// seconds. The thread count hill climbs on completed frames per second within
+// [1, Globals->parallelism], more frames are allowed in flight while reads
+// stall on an empty frame pool and threads sit idle, and the configuration
+// that was settled on is logged so it can be reused as fixed settings.
+class StreamTuner
+{
+public:
+    StreamTuner() : threads(NULL), source(NULL), tuning(false) {}
+
+    void start(QThreadPool *_threads, DataSource *_source, int _maxFrames, int _tuneTime)
+    {
+        threads = _threads;
+        source = _source;
+        maxFrames = _maxFrames;
+        maxThreads = std::max(1, Globals->parallelism);
+        tuneTime = _tuneTime;
+        step = -1;
+        bestThreads = threads->maxThreadCount();
+        bestRate = previousRate = 0;
+        windowStart = 0;
+        lastReturned = source->returnedFrames();
+        lastStarved = source->starvedReads();
+        tuning = true;
+        timer.start();
+    }
+
+    // Only called from the read stage, which runs on one thread at a time
+    void update()
+    {
+        if (!tuning)
+            return;
+
+        const qint64 elapsed = timer.elapsed();
+        if (elapsed - windowStart < window)
+            return;
+
+        const int returned = source->returnedFrames();
+        const int starved = source->starvedReads();
+        const double rate = (returned - lastReturned) * 1000.0 / (elapsed - windowStart);
+        const int currentThreads = threads->maxThreadCount();
+
+        if (rate > bestRate) {
+            bestRate = rate;
+            bestThreads = currentThreads;
+        }
+
+        if ((starved > lastStarved) && (threads->activeThreadCount() < currentThreads) && (source->frames() < maxFrames))
+            source->addFrames(std::min(maxFrames - source->frames(), std::max(1, source->frames() / 2)));
+
+        if (elapsed >= tuneTime) {
+            threads->setMaxThreadCount(bestThreads);
+            finish();
+            return;
+        }
+
+        // Keep moving while throughput improves, otherwise turn around
+        if (rate < previousRate)
+            step = -step;
+        threads->setMaxThreadCount(std::max(1, std::min(maxThreads, currentThreads + step)));
+
+        previousRate = rate;
+        lastReturned = returned;
+        lastStarved = starved;
+        windowStart = elapsed;
+    }
+
+    void finish()
+    {
+        if (!tuning)
+            return;
+        tuning = false;
+        qDebug("Stream tuned to parallelism=%d activeFrames=%d readBlockSize=%d (%.1f frames/s)",
+               threads->maxThreadCount(), source->frames(), source->readBlockSize(), bestRate);
+    }
+
+private:
+    static const int window = 500; // ms
+
+    QThreadPool *threads;
+    DataSource *source;
+    bool tuning;
+    QElapsedTimer timer;
+
+    int maxFrames, maxThreads, tuneTime;
+    int step, bestThreads;
+    double bestRate, previousRate;
+    qint64 windowStart;
+    int lastReturned, lastStarved;
+};
+
 class ProcessingStage;
 
 class BasicLoop : public QRunnable, public QFutureInterface<void>
@@ -574,6 +733,8 @@ public:
     ProcessingStage(int nThreads = 1)
     {
         thread_count = nThreads;
+        transform = NULL;
+        framesProcessed = projectLatency = queueDepth = NULL;
     }
     virtual ~ProcessingStage() {}
 
@@ -587,9 +748,23 @@ public:
 
     virtual void status()=0;
 
+    // Called once stage_id and transform are assigned
+    void initMetrics()
+    {
+        const QString name = transform ? QString(transform->metaObject()->className()).remove("br::").remove("Transform") : QString("Read");
+        const QString labels = QString("{stage=\"%1\",transform=\"%2\"}").arg(stage_id).arg(name);
+        framesProcessed = Metrics::counter("br_stream_frames_total" + labels);
+        projectLatency = Metrics::histogram("br_stream_stage_seconds" + labels);
+        queueDepth = Metrics::gauge("br_stream_queue_depth" + labels);
+    }
+
 protected:
     int thread_count;
 
+    Metric *framesProcessed;
+    Metric *projectLatency;
+    Metric *queueDepth;
+
     SharedBuffer *inputBuffer;
     ProcessingStage *nextStage;
     QList<ProcessingStage *> * stages;
@@ -614,9 +789,12 @@ public:
         TemplateList ftes;
         splitFTEs(input->data, ftes);
         TemplateList res;
-        transform->project(input->data, res);
-        input->data = res;
-        input->data.append(ftes);
+        {
+            MetricTimer timer(projectLatency);
+            transform->project(input->data, res);
+        }
+        framesProcessed->add();
+        input->replaceData(res, ftes);
 
         should_continue = nextStage->tryAcquireNextStage(input, final);
 
@@ -696,9 +874,12 @@ public:
         TemplateList ftes;
         splitFTEs(input->data, ftes);
         TemplateList res;
-        transform->projectUpdate(input->data, res);
-        input->data = res;
-        input->data.append(ftes);
+        {
+            MetricTimer timer(projectLatency);
+            transform->projectUpdate(input->data, res);
+        }
+        framesProcessed->add();
+        input->replaceData(res, ftes);
 
         should_continue = nextStage->tryAcquireNextStage(input,final);
 
@@ -713,6 +894,7 @@ public:
             this->currentStatus = STOPPING;
         }
         lock.unlock();
+        queueDepth->set(inputBuffer->size());
 
         if (newItem)
             startThread(newItem);
@@ -741,6 +923,7 @@ public:
     {
         final = false;
         inputBuffer->addItem(input);
+        queueDepth->set(inputBuffer->size());
 
         QReadLocker lock(&statusLock);
         // Thread is already running, we should just return
@@ -785,14 +968,23 @@ public:
     // Calledfrom a different thread than run.
     bool tryAcquireNextStage(FrameData *& input, bool &final)
     {
+        static Metric *templates = Metrics::counter("br_stream_templates_total");
+        static Metric *ftes = Metrics::counter("br_stream_fte_total");
+
+        int fteCount = 0;
         for (int i=0; i < input->data.size(); i++) {
-            if (input->data[i].file.fte) {
-                input->data[i].file.fte = false;
-                input->data[i].file.set("FTE",QVariant::fromValue(true));
+            File &file = input->data[i].file;
+            const bool fte = file.fte;
+            if (fte) {
+                file.fte = false;
+                fteCount++;
             }
-            else
-                input->data[i].file.set("FTE",QVariant::fromValue(false));
+            // Skip the write, and the detach it may cause, if the flag is already recorded
+            if (!file.contains("FTE") || (file.get<bool>("FTE") != fte))
+                file.set("FTE",QVariant::fromValue(fte));
         }
+        templates->add(input->data.size());
+        ftes->add(fteCount);
         
         return SingleThreadStage::tryAcquireNextStage(input, final);
     }
@@ -836,12 +1028,13 @@ public:
     void projectUpdate(const TemplateList &src, TemplateList &dst)
     {
         (void) dst;
-        data.append(src);
+        if (data.empty()) data = src;
+        else              data.append(src);
     }
 
     void finalize(TemplateList &output)
     {
-        output = data;
+        output.swap(data);
         data.clear();
     }
     void train(const TemplateList &data)
@@ -858,9 +1051,11 @@ public:
     ReadStage(int activeFrames = 100) : SingleThreadStage(true), dataSource(activeFrames){ }
 
     DataSource dataSource;
+    StreamTuner tuner;
 
     void reset()
     {
+        tuner.finish();
         dataSource.close();
         SingleThreadStage::reset();
     }
@@ -869,6 +1064,8 @@ public:
     {
         if (input == NULL)
             qFatal("NULL frame in input stage");
+        framesProcessed->add();
+        tuner.update();
 
         // Can we enter the next stage?
         should_continue = nextStage->tryAcquireNextStage(input, final);
@@ -949,6 +1146,12 @@ void BasicLoop::run()
     FrameData *target_item = startItem;
     bool should_continue = true;
     bool the_end = false;
+
+    // Frames are spread round-robin across nodes, and stay on their node for every stage this loop runs
+    QScopedPointer<NumaBinding> binding;
+    if (Globals->pinStages && target_item)
+        binding.reset(new NumaBinding(target_item->sequenceNumber % Numa::nodes()));
+
     forever
     {
         target_item = stages->at(current_idx)->run(target_item, should_continue, the_end);
@@ -974,9 +1177,15 @@ public:
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
     Q_PROPERTY(br::Idiocy::StreamModes readMode READ get_readMode WRITE set_readMode RESET reset_readMode)
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
+    Q_PROPERTY(bool autoTune READ get_autoTune WRITE set_autoTune RESET reset_autoTune STORED false)
+    Q_PROPERTY(int maxActiveFrames READ get_maxActiveFrames WRITE set_maxActiveFrames RESET reset_maxActiveFrames STORED false)
+    Q_PROPERTY(int tuneTime READ get_tuneTime WRITE set_tuneTime RESET reset_tuneTime STORED false)
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Idiocy::StreamModes, readMode, br::Idiocy::StreamGallery)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    BR_PROPERTY(bool, autoTune, false)
+    BR_PROPERTY(int, maxActiveFrames, 1000)
+    BR_PROPERTY(int, tuneTime, 10000)
 
     friend class StreamTransfrom;
 
@@ -1079,12 +1288,16 @@ public:
         if (src.empty())
             return;
 
+        readStage->dataSource.adaptiveReads = autoTune;
         bool res = readStage->dataSource.open(src,readMode);
         if (!res) {
             qDebug("stream failed to open %s", qPrintable(dst[0].file.name));
             return;
         }
 
+        if (autoTune)
+            readStage->tuner.start(threads, &readStage->dataSource, std::max(activeFrames, maxActiveFrames), tuneTime);
+
         // Start the first thread in the stream.
         QWriteLocker lock(&readStage->statusLock);
         readStage->currentStatus = SingleThreadStage::STARTING;
@@ -1223,6 +1436,9 @@ public:
         // And the collection stage points to the read stage, because this is
         // a ring buffer.
         collectionStage->nextStage = readStage;
+
+        foreach (ProcessingStage *stage, processingStages)
+            stage->initMetrics();
     }
 
     ~DirectStreamTransform()
@@ -1292,9 +1508,16 @@ public:
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
     Q_PROPERTY(br::Idiocy::StreamModes readMode READ get_readMode WRITE set_readMode RESET reset_readMode)
 
+    Q_PROPERTY(bool autoTune READ get_autoTune WRITE set_autoTune RESET reset_autoTune STORED false)
+    Q_PROPERTY(int maxActiveFrames READ get_maxActiveFrames WRITE set_maxActiveFrames RESET reset_maxActiveFrames STORED false)
+    Q_PROPERTY(int tuneTime READ get_tuneTime WRITE set_tuneTime RESET reset_tuneTime STORED false)
+
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Idiocy::StreamModes, readMode, br::Idiocy::StreamGallery)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    BR_PROPERTY(bool, autoTune, false)
+    BR_PROPERTY(int, maxActiveFrames, 1000)
+    BR_PROPERTY(int, tuneTime, 10000)
 
     bool timeVarying() const { return true; }
 
@@ -1337,6 +1560,9 @@ public:
         basis->activeFrames = this->activeFrames;
         basis->readMode = this->readMode;
         basis->endPoint = this->endPoint;
+        basis->autoTune = this->autoTune;
+        basis->maxActiveFrames = this->maxActiveFrames;
+        basis->tuneTime = this->tuneTime;
 
         // We need at least a CompositeTransform * to acess transform's children.
         CompositeTransform *downcast = dynamic_cast<CompositeTransform *> (transform);
@@ -1409,6 +1635,9 @@ public:
         // We just want the DirectStream to begin with, so just return a copy of that.
         DirectStreamTransform *res = (DirectStreamTransform *) basis->smartCopy(newTransform);
         res->activeFrames = this->activeFrames;
+        res->autoTune = this->autoTune;
+        res->maxActiveFrames = this->maxActiveFrames;
+        res->tuneTime = this->tuneTime;
         return res;
     }
 
@@ -95,6 +95,107 @@ static void trainSVM(SVM &svm, Mat data, Mat lab, int kernel, int type, float C,
     qDebug("SVM C = %f  Gamma = %f  Support Vectors = %d", p.C, p.gamma, svm.get_support_vector_count());
 }
 
+/*!
+ * \brief CvSVM with batched prediction for linear and RBF kernels.
+ *
+ * The decision function of every class pair is expanded into a column of a dense coefficient matrix,
+ * so a block of samples is scored with one kernel matrix product followed by one coefficient product.
+ * Linear kernels fold the support vectors into the coefficients, leaving a single product per block.
+ */
+class BatchSVM : public SVM
+{
+    Mat supportVectors, supportVectorNorms, coefficients, rhos;
+    QList<int> classLabels;
+    bool returnDFVal, batchable;
+
+public:
+    BatchSVM() : returnDFVal(false), batchable(false) {}
+
+    bool canPredictBlock() const { return batchable; }
+
+    void prepare(bool returnDFVal)
+    {
+        this->returnDFVal = returnDFVal;
+        const int kernel = params.kernel_type;
+        const int svCount = get_support_vector_count();
+        const int dims = get_var_count();
+        batchable = decision_func && !var_idx && (svCount > 0) &&
+                    ((kernel == CvSVM::LINEAR) || (kernel == CvSVM::RBF));
+        if (!batchable)
+            return;
+
+        supportVectors.create(svCount, dims, CV_32FC1);
+        for (int i=0; i<svCount; i++)
+            memcpy(supportVectors.ptr(i), get_support_vector(i), dims * sizeof(float));
+        reduce(supportVectors.mul(supportVectors), supportVectorNorms, 1, CV_REDUCE_SUM);
+        supportVectorNorms = supportVectorNorms.t();
+
+        classLabels.clear();
+        const bool classification = (params.svm_type == CvSVM::C_SVC) || (params.svm_type == CvSVM::NU_SVC);
+        if (classification)
+            for (int i=0; i<class_labels->cols; i++)
+                classLabels.append(class_labels->data.i[i]);
+
+        // One decision function per class pair, or a single function over all support vectors
+        const int functions = classification ? classLabels.size() * (classLabels.size() - 1) / 2 : 1;
+        Mat alphas(svCount, functions, CV_32FC1, Scalar::all(0));
+        rhos.create(1, functions, CV_32FC1);
+        const CvSVMDecisionFunc *df = (const CvSVMDecisionFunc*) decision_func;
+        for (int f=0; f<functions; f++, df++) {
+            for (int k=0; k<df->sv_count; k++)
+                alphas.at<float>(classification ? df->sv_index[k] : k, f) = df->alpha[k];
+            rhos.at<float>(0, f) = df->rho;
+        }
+
+        if (kernel == CvSVM::LINEAR) coefficients = supportVectors.t() * alphas;
+        else                         coefficients = alphas;
+    }
+
+    void predictBlock(const Mat &samples, Mat responses) const
+    {
+        Mat sums;
+        if (params.kernel_type == CvSVM::LINEAR) {
+            sums = samples * coefficients;
+        } else {
+            // exp(-gamma * ||x - sv||^2) expanded as norms minus twice the cross product
+            Mat sampleNorms, kernel = samples * supportVectors.t();
+            reduce(samples.mul(samples), sampleNorms, 1, CV_REDUCE_SUM);
+            for (int i=0; i<kernel.rows; i++) {
+                float *row = kernel.ptr<float>(i);
+                for (int j=0; j<kernel.cols; j++)
+                    row[j] = -params.gamma * std::max(0.f, sampleNorms.at<float>(i, 0) + supportVectorNorms.at<float>(0, j) - 2*row[j]);
+            }
+            exp(kernel, kernel);
+            sums = kernel * coefficients;
+        }
+
+        for (int i=0; i<sums.rows; i++) {
+            const float *sum = sums.ptr<float>(i);
+            float &response = responses.at<float>(i, 0);
+
+            if (classLabels.isEmpty()) {
+                const float value = sum[0] - rhos.at<float>(0, 0);
+                response = (params.svm_type == CvSVM::ONE_CLASS) ? (float)(value > 0) : value;
+                continue;
+            }
+
+            // Pairwise voting in the same order as CvSVM::predict
+            QVector<int> votes(classLabels.size(), 0);
+            float value = 0;
+            for (int a=0, f=0; a<classLabels.size(); a++)
+                for (int b=a+1; b<classLabels.size(); b++, f++) {
+                    value = sum[f] - rhos.at<float>(0, f);
+                    votes[value > 0 ? a : b]++;
+                }
+            int best = 0;
+            for (int c=1; c<votes.size(); c++)
+                if (votes[c] > votes[best])
+                    best = c;
+            response = (returnDFVal && (classLabels.size() == 2)) ? value : classLabels[best];
+        }
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief C. Burges. "A tutorial on support vector machines for pattern recognition,"
@@ -141,7 +242,7 @@ private:
     BR_PROPERTY(int, folds, 5)
     BR_PROPERTY(bool, balanceFolds, false)
 
-    SVM svm;
+    BatchSVM svm;
     QHash<QString, int> labelMap;
     QHash<int, QVariant> reverseLookup;
 
@@ -162,6 +263,7 @@ private:
         }
 
         trainSVM(svm, data, lab, kernel, type, C, gamma, folds, balanceFolds, termCriteria);
+        svm.prepare(returnDFVal);
     }
 
     void project(const Template &src, Template &dst) const
@@ -170,7 +272,30 @@ private:
             qFatal("Decision function for multiclass classification not implemented.");
 
         dst = src;
-        float prediction = svm.predict(src.m().reshape(1, 1), returnDFVal);
+        setPrediction(svm.predict(src.m().reshape(1, 1), returnDFVal), dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        const Mat samples = svm.canPredictBlock() ? stackSamples(src) : Mat();
+        if (samples.empty()) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        if (returnDFVal && reverseLookup.size() > 2)
+            qFatal("Decision function for multiclass classification not implemented.");
+
+        Mat predictions(samples.rows, 1, CV_32FC1);
+        predictBlocks(&svm, samples, predictions);
+
+        dst = src;
+        for (int i=0; i<dst.size(); i++)
+            setPrediction(predictions.at<float>(i, 0), dst[i]);
+    }
+
+    void setPrediction(float prediction, Template &dst) const
+    {
         if (returnDFVal) {
             dst.m() = Mat(1, 1, CV_32F);
             dst.m().at<float>(0, 0) = prediction;
@@ -198,6 +323,7 @@ private:
     {
         loadSVM(svm, stream);
         stream >> labelMap >> reverseLookup;
+        svm.prepare(returnDFVal);
     }
 
     void init()
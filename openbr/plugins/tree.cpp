@@ -44,6 +44,112 @@ static void loadModel(CvStatModel &model, QDataStream &stream)
     model.load(qPrintable(tempFile.fileName()));
 }
 
+/*!
+ * \brief CvRTrees flattened into a contiguous node array for evaluating many samples at once.
+ *
+ * Trees are evaluated one at a time over the whole block of samples so each tree stays in cache.
+ * Only ordered splits are flattened, forests with categorical inputs are predicted by OpenCV.
+ */
+class BatchRTrees : public CvRTrees
+{
+    struct Node
+    {
+        int var, left, right, classIndex; // left < 0 for leaves
+        float threshold;
+        double value;
+    };
+
+    QVector<Node> nodes;
+    QVector<int> roots;
+    bool probability, batchable;
+
+    bool flatten(const CvDTreeNode *node, const int *varType)
+    {
+        const int index = nodes.size();
+        nodes.append(Node());
+        nodes[index].classIndex = node->class_idx;
+        nodes[index].value = node->value;
+        nodes[index].left = nodes[index].right = -1;
+        if (!node->left)
+            return true;
+
+        const CvDTreeSplit *split = node->split;
+        if (!split || (varType[split->var_idx] >= 0))
+            return false;
+        nodes[index].var = split->var_idx;
+        nodes[index].threshold = split->ord.c;
+
+        const CvDTreeNode *left = split->inversed ? node->right : node->left;
+        const CvDTreeNode *right = split->inversed ? node->left : node->right;
+        nodes[index].left = nodes.size();
+        if (!flatten(left, varType)) return false;
+        nodes[index].right = nodes.size();
+        return flatten(right, varType);
+    }
+
+    inline const Node &leaf(int tree, const float *sample) const
+    {
+        const Node *node = &nodes[roots[tree]];
+        while (node->left >= 0)
+            node = &nodes[sample[node->var] <= node->threshold ? node->left : node->right];
+        return *node;
+    }
+
+public:
+    BatchRTrees() : probability(false), batchable(false) {}
+
+    bool canPredictBlock() const { return batchable; }
+
+    void prepare(bool probability)
+    {
+        this->probability = probability;
+        nodes.clear();
+        roots.clear();
+        batchable = (ntrees > 0) && (!probability || (nclasses == 2));
+        for (int i=0; batchable && (i<ntrees); i++) {
+            const CvDTreeTrainData *data = trees[i]->get_data();
+            batchable = data && !data->var_idx && trees[i]->get_root();
+            if (!batchable)
+                break;
+            roots.append(nodes.size());
+            batchable = flatten(trees[i]->get_root(), data->var_type->data.i);
+        }
+        if (!batchable) {
+            nodes.clear();
+            roots.clear();
+        }
+    }
+
+    // Matches CvRTrees::predict and CvRTrees::predict_prob
+    void predictBlock(const Mat &samples, Mat responses) const
+    {
+        const int n = samples.rows;
+        if (nclasses > 0) {
+            // Track votes per sample, iterating trees in the outer loop
+            QVector<int> votes(n * nclasses, 0), maxVotes(n, 0);
+            QVector<double> results(n, 0);
+            for (int t=0; t<ntrees; t++)
+                for (int i=0; i<n; i++) {
+                    const Node &node = leaf(t, samples.ptr<float>(i));
+                    const int nvotes = ++votes[i*nclasses + node.classIndex];
+                    if (nvotes > maxVotes[i]) {
+                        maxVotes[i] = nvotes;
+                        results[i] = node.value;
+                    }
+                }
+            for (int i=0; i<n; i++)
+                responses.at<float>(i, 0) = probability ? float(votes[i*nclasses + 1]) / ntrees : results[i];
+        } else {
+            QVector<double> results(n, 0);
+            for (int t=0; t<ntrees; t++)
+                for (int i=0; i<n; i++)
+                    results[i] += leaf(t, samples.ptr<float>(i)).value;
+            for (int i=0; i<n; i++)
+                responses.at<float>(i, 0) = results[i] / ntrees;
+        }
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV's random trees framework
@@ -72,7 +178,7 @@ class ForestTransform : public Transform
     BR_PROPERTY(QString, inputVariable, "Label")
     BR_PROPERTY(QString, outputVariable, "")
 
-    CvRTrees forest;
+    BatchRTrees forest;
 
     void train(const TemplateList &data)
     {
@@ -103,6 +209,7 @@ class ForestTransform : public Transform
                                CV_TERMCRIT_ITER | CV_TERMCRIT_EPS));
 
         qDebug() << "Number of trees:" << forest.get_tree_count();
+        forest.prepare(classification && returnConfidence);
     }
 
     void project(const Template &src, Template &dst) const
@@ -117,6 +224,27 @@ class ForestTransform : public Transform
             response = forest.predict(src.m().reshape(1,1));
         }
 
+        setResponse(response, dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        const Mat samples = forest.canPredictBlock() ? stackSamples(src) : Mat();
+        if (samples.empty()) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        Mat responses(samples.rows, 1, CV_32FC1);
+        predictBlocks(&forest, samples, responses);
+
+        dst = src;
+        for (int i=0; i<dst.size(); i++)
+            setResponse(responses.at<float>(i, 0), dst[i]);
+    }
+
+    void setResponse(float response, Template &dst) const
+    {
         if (overwriteMat) {
             dst.m() = Mat(1, 1, CV_32F);
             dst.m().at<float>(0, 0) = response;
@@ -128,6 +256,7 @@ class ForestTransform : public Transform
     void load(QDataStream &stream)
     {
         loadModel(forest,stream);
+        forest.prepare(classification && returnConfidence);
     }
 
     void store(QDataStream &stream) const
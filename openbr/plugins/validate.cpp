@@ -139,7 +139,7 @@ BR_REGISTER(Transform, CrossValidateTransform)
  * \brief Cross validate a distance metric.
  * \author Josh Klontz \cite jklontz
  */
-class CrossValidateDistance : public Distance
+class CrossValidateDistance : public MetadataFilterDistance
 {
     Q_OBJECT
 
@@ -150,6 +150,27 @@ class CrossValidateDistance : public Distance
         const int partitionB = b.file.get<int>(key, 0);
         return (partitionA != partitionB) ? -std::numeric_limits<float>::max() : 0;
     }
+
+    QStringList indexKeys() const
+    {
+        return QStringList() << "Partition";
+    }
+
+    QString indexValue(const File &target, const QString &key) const
+    {
+        return QString::number(target.get<int>(key, 0));
+    }
+
+    bool accepts(const QString &key, const QString &value, const Template &query) const
+    {
+        return value.toInt() == query.file.get<int>(key, 0);
+    }
+
+    bool acceptedValues(const QString &key, const Template &query, QStringList &values) const
+    {
+        values.append(QString::number(query.file.get<int>(key, 0)));
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, CrossValidateDistance)
@@ -159,7 +180,7 @@ BR_REGISTER(Distance, CrossValidateDistance)
  * \brief Checks target metadata against filters.
  * \author Josh Klontz \cite jklontz
  */
-class FilterDistance : public Distance
+class FilterDistance : public MetadataFilterDistance
 {
     Q_OBJECT
 
@@ -181,6 +202,30 @@ class FilterDistance : public Distance
         }
         return 0;
     }
+
+    QStringList indexKeys() const
+    {
+        QStringList keys;
+        foreach (const QString &key, Globals->filters.keys())
+            if (!Globals->filters[key].isEmpty())
+                keys.append(key);
+        return keys;
+    }
+
+    bool accepts(const QString &key, const QString &value, const Template &query) const
+    {
+        (void) query;
+        return !value.isEmpty() && Globals->filters[key].contains(value);
+    }
+
+    bool acceptedValues(const QString &key, const Template &query, QStringList &values) const
+    {
+        (void) query;
+        foreach (const QString &value, Globals->filters[key])
+            if (!value.isEmpty())
+                values.append(value);
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, FilterDistance)
@@ -190,7 +235,7 @@ BR_REGISTER(Distance, FilterDistance)
  * \brief Checks target metadata against query metadata.
  * \author Scott Klum \cite sklum
  */
-class MetadataDistance : public Distance
+class MetadataDistance : public MetadataFilterDistance
 {
     Q_OBJECT
 
@@ -199,37 +244,57 @@ class MetadataDistance : public Distance
 
     float compare(const Template &a, const Template &b) const
     {
-        foreach (const QString &key, filters) {
-            QString aValue = a.file.get<QString>(key, QString());
-            QString bValue = b.file.get<QString>(key, QString());
+        foreach (const QString &key, filters)
+            if (!keep(a.file.get<QString>(key, QString()), queryValue(b, key)))
+                return -std::numeric_limits<float>::max();
+        return 0;
+    }
 
-            // The query value may be a range. Let's check.
-            if (bValue.isEmpty()) bValue = QtUtils::toString(b.file.get<QPointF>(key, QPointF()));
+    QStringList indexKeys() const
+    {
+        return filters;
+    }
 
-            if (aValue.isEmpty() || bValue.isEmpty()) continue;
+    bool accepts(const QString &key, const QString &value, const Template &query) const
+    {
+        return keep(value, queryValue(query, key));
+    }
 
-            bool keep = false;
-            bool ok;
+    bool acceptedValues(const QString &key, const Template &query, QStringList &values) const
+    {
+        const QString value = queryValue(query, key);
+        if (value.isEmpty())
+            return false; // Accepts everything
 
-            QPointF range = QtUtils::toPoint(bValue,&ok);
+        bool range;
+        QtUtils::toPoint(value, &range);
+        if (range)
+            return false;
 
-            if (ok) /* Range */ {
-                int value = range.x();
-                int upperBound = range.y();
+        values << QString() << value; // Targets without the key are kept too
+        return true;
+    }
 
-                while (value <= upperBound) {
-                    if (aValue == QString::number(value)) {
-                        keep = true;
-                        break;
-                    }
-                    value++;
-                }
-            }
-            else if (aValue == bValue) keep = true;
+    static QString queryValue(const Template &query, const QString &key)
+    {
+        const QString value = query.file.get<QString>(key, QString());
 
-            if (!keep) return -std::numeric_limits<float>::max();
+        // The query value may be a range. Let's check.
+        return value.isEmpty() ? QtUtils::toString(query.file.get<QPointF>(key, QPointF())) : value;
+    }
+
+    static bool keep(const QString &aValue, const QString &bValue)
+    {
+        if (aValue.isEmpty() || bValue.isEmpty()) return true;
+
+        bool ok;
+        QPointF range = QtUtils::toPoint(bValue,&ok);
+
+        if (ok) /* Range */ {
+            const int value = aValue.toInt(&ok);
+            return ok && (aValue == QString::number(value)) && (value >= int(range.x())) && (value <= int(range.y()));
         }
-        return 0;
+        return aValue == bValue;
     }
 };
 
@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QMutex>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
 
@@ -55,6 +56,7 @@ private:
 
     Mat kReal, kImaginary;
 
+    friend class GaborBank;
     friend class GaborJetTransform;
 
     static void makeWavelet(float lambda, float theta, float psi, float sigma, float gamma, Mat &kReal, Mat &kImaginary)
@@ -115,6 +117,209 @@ private:
 
 BR_REGISTER(Transform, GaborTransform)
 
+/*!
+ * \brief Applies a bank of gabor wavelets with a single forward DFT of the image.
+ *
+ * Each wavelet contributes one inverse DFT of the shared image spectrum multiplied by the wavelet spectrum.
+ * Wavelet spectra depend on the padded image size, so they are computed on first use and cached.
+ * Banks whose largest kernel is no larger than \em maxSpatialSize are applied with filter2D instead.
+ */
+class GaborBank
+{
+    QList<Mat> kReals, kImaginaries;
+    Size maxKernel;
+
+    mutable QMutex mutex;
+    mutable QHash< QPair<int,int>, QList<Mat> > spectraCache;
+
+    QList<Mat> spectra(const Size &padded) const
+    {
+        QMutexLocker locker(&mutex);
+        const QPair<int,int> key(padded.width, padded.height);
+        if (!spectraCache.contains(key)) {
+            if (spectraCache.size() >= 16)
+                spectraCache.clear(); // Bound memory usage for inputs of varying size
+
+            QList<Mat> kernelSpectra;
+            for (int i=0; i<kReals.size(); i++) {
+                const Mat &kReal = kReals[i];
+                const Mat &kImaginary = kImaginaries[i];
+
+                // Conjugate complex kernel with its anchor wrapped to the origin
+                Mat kernel(padded, CV_32FC2, Scalar::all(0));
+                for (int y=0; y<kReal.rows; y++) {
+                    const int row = (y - kReal.rows/2 + padded.height) % padded.height;
+                    for (int x=0; x<kReal.cols; x++) {
+                        const int col = (x - kReal.cols/2 + padded.width) % padded.width;
+                        kernel.at<Vec2f>(row, col) = Vec2f(kReal.at<float>(y, x), -kImaginary.at<float>(y, x));
+                    }
+                }
+
+                Mat kernelSpectrum;
+                dft(kernel, kernelSpectrum);
+                kernelSpectra.append(kernelSpectrum);
+            }
+            spectraCache.insert(key, kernelSpectra);
+        }
+        return spectraCache.value(key);
+    }
+
+public:
+    int maxSpatialSize;
+
+    GaborBank() : maxSpatialSize(7) {}
+
+    void clear()
+    {
+        QMutexLocker locker(&mutex);
+        kReals.clear();
+        kImaginaries.clear();
+        maxKernel = Size(0, 0);
+        spectraCache.clear();
+    }
+
+    void append(float lambda, float theta, float psi, float sigma, float gamma)
+    {
+        Mat kReal, kImaginary;
+        GaborTransform::makeWavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
+
+        QMutexLocker locker(&mutex);
+        kReals.append(kReal);
+        kImaginaries.append(kImaginary);
+        maxKernel = Size(std::max(maxKernel.width, kReal.cols), std::max(maxKernel.height, kReal.rows));
+        spectraCache.clear();
+    }
+
+    int size() const { return kReals.size(); }
+    const Mat &real(int index) const { return kReals[index]; }
+    const Mat &imaginary(int index) const { return kImaginaries[index]; }
+    bool spatial() const { return (maxKernel.width <= maxSpatialSize) && (maxKernel.height <= maxSpatialSize); }
+
+    Size paddedSize(const Size &image) const
+    {
+        return Size(getOptimalDFTSize(image.width + maxKernel.width - 1),
+                    getOptimalDFTSize(image.height + maxKernel.height - 1));
+    }
+
+    /*!
+     * \brief Equivalent to calling filter2D on \em src with the real and imaginary kernel of every wavelet.
+     */
+    void filter(const Mat &src, QList<Mat> &reals, QList<Mat> &imaginaries) const
+    {
+        reals.clear();
+        imaginaries.clear();
+        if (kReals.isEmpty())
+            return;
+
+        Mat image;
+        src.convertTo(image, CV_32F);
+
+        if (spatial()) {
+            for (int i=0; i<kReals.size(); i++) {
+                Mat real, imaginary;
+                filter2D(image, real, CV_32F, kReals[i]);
+                filter2D(image, imaginary, CV_32F, kImaginaries[i]);
+                reals.append(real);
+                imaginaries.append(imaginary);
+            }
+            return;
+        }
+
+        // Reflect the border like filter2D, with enough padding that the circular correlation never wraps
+        const Size padded = paddedSize(image.size());
+        const int top = maxKernel.height/2, left = maxKernel.width/2;
+        Mat bordered, spectrum;
+        copyMakeBorder(image, bordered, top, padded.height - image.rows - top, left, padded.width - image.cols - left, BORDER_REFLECT_101);
+        dft(bordered, spectrum, DFT_COMPLEX_OUTPUT);
+
+        const QList<Mat> kernelSpectra = spectra(padded);
+        const Rect roi(left, top, image.cols, image.rows);
+        Mat product, response;
+        foreach (const Mat &kernelSpectrum, kernelSpectra) {
+            mulSpectrums(spectrum, kernelSpectrum, product, 0, true);
+            dft(product, response, DFT_INVERSE | DFT_SCALE);
+            Mat planes[2];
+            split(response(roi), planes);
+            reals.append(planes[0]);
+            imaginaries.append(planes[1]);
+        }
+    }
+};
+
+/*!
+ * \ingroup transforms
+ * \brief A bank of gabor wavelets applied to the entire image in one pass.
+ *
+ * The bank contains a wavelet for every combination of \em lambdas, \em thetas, \em psis, \em sigmas, and \em gammas.
+ * For each wavelet one matrix is appended per entry in \em components, in the same order,
+ * with the same values as the equivalent <tt>Gabor(lambda,theta,psi,sigma,gamma,component)</tt> on a floating point image.
+ * \see GaborBank
+ */
+class GaborBankTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QList<float> lambdas READ get_lambdas WRITE set_lambdas RESET reset_lambdas STORED false)
+    Q_PROPERTY(QList<float> thetas READ get_thetas WRITE set_thetas RESET reset_thetas STORED false)
+    Q_PROPERTY(QList<float> psis READ get_psis WRITE set_psis RESET reset_psis STORED false)
+    Q_PROPERTY(QList<float> sigmas READ get_sigmas WRITE set_sigmas RESET reset_sigmas STORED false)
+    Q_PROPERTY(QList<float> gammas READ get_gammas WRITE set_gammas RESET reset_gammas STORED false)
+    Q_PROPERTY(QStringList components READ get_components WRITE set_components RESET reset_components STORED false)
+    Q_PROPERTY(int maxSpatialSize READ get_maxSpatialSize WRITE set_maxSpatialSize RESET reset_maxSpatialSize STORED false)
+    BR_PROPERTY(QList<float>, lambdas, QList<float>())
+    BR_PROPERTY(QList<float>, thetas, QList<float>())
+    BR_PROPERTY(QList<float>, psis, QList<float>())
+    BR_PROPERTY(QList<float>, sigmas, QList<float>())
+    BR_PROPERTY(QList<float>, gammas, QList<float>())
+    BR_PROPERTY(QStringList, components, QStringList() << "Phase")
+    BR_PROPERTY(int, maxSpatialSize, 7)
+
+    GaborBank bank;
+    QList<GaborTransform::Component> componentList;
+
+    void init()
+    {
+        componentList.clear();
+        foreach (const QString &component, components) {
+            if      (component == "Real")      componentList.append(GaborTransform::Real);
+            else if (component == "Imaginary") componentList.append(GaborTransform::Imaginary);
+            else if (component == "Magnitude") componentList.append(GaborTransform::Magnitude);
+            else if (component == "Phase")     componentList.append(GaborTransform::Phase);
+            else                               qFatal("Invalid component: %s", qPrintable(component));
+        }
+
+        bank.clear();
+        bank.maxSpatialSize = maxSpatialSize;
+        foreach (float lambda, lambdas)
+            foreach (float theta, thetas)
+                foreach (float psi, psis)
+                    foreach (float sigma, sigmas)
+                        foreach (float gamma, gammas)
+                            bank.append(lambda, theta, psi, sigma, gamma);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        QList<Mat> reals, imaginaries;
+        bank.filter(src, reals, imaginaries);
+
+        dst.file = src.file;
+        for (int i=0; i<reals.size(); i++) {
+            Mat magnitude, phase;
+            if (componentList.contains(GaborTransform::Magnitude) || componentList.contains(GaborTransform::Phase))
+                cartToPolar(reals[i], imaginaries[i], magnitude, phase);
+
+            foreach (GaborTransform::Component component, componentList) {
+                if      (component == GaborTransform::Real)      dst.append(reals[i]);
+                else if (component == GaborTransform::Imaginary) dst.append(imaginaries[i]);
+                else if (component == GaborTransform::Magnitude) dst.append(magnitude);
+                else                                             dst.append(phase);
+            }
+        }
+    }
+};
+
+BR_REGISTER(Transform, GaborBankTransform)
+
 /*!
  * \ingroup transforms
  * \brief A vector of gabor wavelets applied at a point.
@@ -137,22 +342,27 @@ class GaborJetTransform : public UntrainableTransform
     BR_PROPERTY(QList<float>, gammas, QList<float>())
     BR_PROPERTY(GaborTransform::Component, component, GaborTransform::Phase)
 
-    QList<Mat> kReals, kImaginaries;
+    GaborBank bank;
 
     void init()
     {
-        kReals.clear();
-        kImaginaries.clear();
+        bank.clear();
         foreach (float lambda, lambdas)
             foreach (float theta, thetas)
                 foreach (float psi, psis)
                     foreach (float sigma, sigmas)
-                        foreach (float gamma, gammas) {
-                            Mat kReal, kImaginary;
-                            GaborTransform::makeWavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
-                            kReals.append(kReal);
-                            kImaginaries.append(kImaginary);
-                        }
+                        foreach (float gamma, gammas)
+                            bank.append(lambda, theta, psi, sigma, gamma);
+    }
+
+    static float value(float real, float imaginary, GaborTransform::Component component)
+    {
+        if      (component == GaborTransform::Real)      return real;
+        else if (component == GaborTransform::Imaginary) return imaginary;
+        else if (component == GaborTransform::Magnitude) return sqrt(real*real + imaginary*imaginary);
+        else if (component == GaborTransform::Phase)     return atan2(imaginary, real)*180/CV_PI;
+        qFatal("Invalid component.");
+        return 0;
     }
 
     static float response(const cv::Mat &src, const QPointF &point, const Mat &kReal, const Mat &kImaginary, GaborTransform::Component component)
@@ -162,38 +372,50 @@ class GaborJetTransform : public UntrainableTransform
                  kReal.cols,
                  kReal.rows);
 
-        float real = 0, imaginary = 0, magnitude = 0, phase = 0;
-        if (component != GaborTransform::Imaginary) {
-            Mat dst;
-            multiply(src(roi), kReal, dst);
-            real = sum(dst)[0];
-        }
-        if (component != GaborTransform::Real) {
-            Mat dst;
-            multiply(src(roi), kImaginary, dst);
-            imaginary = sum(dst)[0];
-        }
-        if ((component == GaborTransform::Magnitude) || (component == GaborTransform::Phase)) {
-            magnitude = sqrt(real*real + imaginary*imaginary);
-            phase = atan2(imaginary, real)*180/CV_PI;
-        }
+        const float real = (component != GaborTransform::Imaginary) ? src(roi).dot(kReal) : 0;
+        const float imaginary = (component != GaborTransform::Real) ? src(roi).dot(kImaginary) : 0;
+        return value(real, imaginary, component);
+    }
+
+    // Rough operation counts for evaluating every point directly versus filtering the whole image with the bank
+    bool preferBank(const Size &size, int points) const
+    {
+        if ((points == 0) || (bank.size() == 0) || bank.spatial())
+            return false;
 
-        float dst = 0;
-        if      (component == GaborTransform::Real)      dst = real;
-        else if (component == GaborTransform::Imaginary) dst = imaginary;
-        else if (component == GaborTransform::Magnitude) dst = magnitude;
-        else if (component == GaborTransform::Phase)     dst = phase;
-        else                                             qFatal("Invalid component.");
-        return dst;
+        double spatialCost = 0;
+        for (int j=0; j<bank.size(); j++)
+            spatialCost += 2 * bank.real(j).total();
+        spatialCost *= points;
+
+        const double area = bank.paddedSize(size).area();
+        const double bankCost = 4 * area * std::log(area) / std::log(2.0) * (bank.size() + 1);
+        return bankCost < spatialCost;
     }
 
     void project(const Template &src, Template &dst) const
     {
         const QList<QPointF> points = src.file.points();
-        dst = Mat(points.size(), kReals.size(), CV_32FC1);
+        const Mat &m = src.m();
+        dst = Mat(points.size(), bank.size(), CV_32FC1);
+
+        QList<Mat> reals, imaginaries;
+        if (preferBank(m.size(), points.size()))
+            bank.filter(m, reals, imaginaries);
+
         for (int i=0; i<points.size(); i++)
-            for (int j=0; j<kReals.size(); j++)
-                    dst.m().at<float>(i,j) = response(src, points[i], kReals[j], kImaginaries[j], component);
+            for (int j=0; j<bank.size(); j++) {
+                const Mat &kReal = bank.real(j);
+                const int x = (int)(points[i].x() - kReal.cols/2.f);
+                const int y = (int)(points[i].y() - kReal.rows/2.f);
+
+                // Filtered responses match the direct response wherever the window isn't clamped to the image
+                if (!reals.isEmpty() && (x >= 0) && (y >= 0) && (x <= m.cols - kReal.cols) && (y <= m.rows - kReal.rows))
+                    dst.m().at<float>(i,j) = value(reals[j].at<float>(y + kReal.rows/2, x + kReal.cols/2),
+                                                   imaginaries[j].at<float>(y + kReal.rows/2, x + kReal.cols/2), component);
+                else
+                    dst.m().at<float>(i,j) = response(m, points[i], kReal, bank.imaginary(j), component);
+            }
     }
 };
 